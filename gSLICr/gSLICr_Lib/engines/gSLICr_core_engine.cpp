@@ -25,6 +25,11 @@ const IntImage * gSLICr::engines::core_engine::Get_Seg_Res()
 	return slic_seg_engine->Get_Seg_Mask();
 }
 
+const SpixelMap * gSLICr::engines::core_engine::Get_Spixel_Map()
+{
+	return slic_seg_engine->Get_Spixel_Map();
+}
+
 void gSLICr::engines::core_engine::Draw_Segmentation_Result(UChar4Image* out_img)
 {
 	slic_seg_engine->Draw_Segmentation_Result(out_img);
@@ -25,6 +25,9 @@ namespace gSLICr
 			// Function to get the pointer to the segmented mask image
 			const IntImage * Get_Seg_Res();
 
+			// Function to get the pointer to the cluster centers (mean color, center, pixel count)
+			const SpixelMap * Get_Spixel_Map();
+
 			// Function to draw segmentation result on out_img
 			void Draw_Segmentation_Result(UChar4Image* out_img);
 			void Draw_Boundary_Mask(MaskImage* out_img);
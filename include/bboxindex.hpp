@@ -0,0 +1,51 @@
+#ifndef __BBOXINDEX_HPP__
+#define __BBOXINDEX_HPP__
+#include <string>
+#include <vector>
+
+namespace spt {
+    /// A labelled bounding box of a frame in image coordinates; bounds are inclusive, like PostGIS's &&
+    struct LabelledBBox {
+        double xmin, ymin, xmax, ymax;
+        /// st_area of the box geometry, which orders matches
+        double area;
+        int xview_type_id;
+        std::string label_name;
+    };
+
+    /// Uniform grid over the bounding boxes of one frame, fetched once, in place of a point-in-bbox query per
+    /// superpixel. Boxes are listed in every cell they overlap (CSR layout), so a point query scans one cell.
+    class BBoxIndex {
+    public:
+        BBoxIndex() {}
+
+        /// cell_size = 0 sizes cells for about one box each over the boxes' extent
+        BBoxIndex *Compute(std::vector<LabelledBBox> bboxes, double cell_size = 0);
+
+        size_t size() const;
+
+        const LabelledBBox &GetBBox(int i) const;
+
+        /// Boxes containing (x, y), smallest area first like sql_match_bbox2's order by st_area
+        void Match(double x, double y, std::vector<int> &matches) const;
+
+        int Count(double x, double y) const;
+
+        /// Boxes intersecting the view, like ST_MakeEnvelope(xmin, ymin, xmax, ymax) && bbox
+        void Intersect(double xmin, double ymin, double xmax, double ymax, std::vector<int> &matches) const;
+
+    protected:
+        /// Sorted by area, so every cell lists its boxes in match order
+        std::vector<LabelledBBox> bboxes;
+        double x0 = 0, y0 = 0, cell = 1;
+        int cols = 0, rows = 0;
+        std::vector<int> offsets;
+        std::vector<int> entries;
+
+        int cell_x(double x) const;
+
+        int cell_y(double y) const;
+    };
+}
+
+#endif
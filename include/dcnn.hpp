@@ -1,15 +1,212 @@
 #ifndef __DCNN_HPP__
 #define __DCNN_HPP__
 
-#ifdef HAS_TF
 #include <string>
+#include <vector>
 #include <memory>
+#include <mutex>
 #include <cstdlib>
+#include <ostream>
 #include <opencv2/core/utility.hpp>
 #include <opencv2/imgproc.hpp>
+#include <opencv2/dnn.hpp>
+#include "pooling.hpp"
+#include "profiler.hpp"
+#ifdef HAS_TF
 #include <tensorflow/core/public/session.h>
 #include <tensorflow/core/platform/env.h>
+#endif
+
+namespace spt::dnn {
+    /// Numeric precision of a model. Reduced-precision variants are exported offline (TF graph transforms,
+    /// ONNX quantization) and sit next to the fp32 file, see ModelVariant().
+    enum class Precision {
+        FP32, FP16, INT8
+    };
+
+    /// "fp32", "fp16" or "int8"
+    bool ParsePrecision(const std::string &name, Precision &precision);
+
+    const char *PrecisionName(Precision precision);
+
+    /// Path of a model's variant: the precision goes before the extension (vgg16sp.frozen.pb -> vgg16sp.frozen.int8.pb)
+    std::string ModelVariant(const std::string &path, Precision precision);
+
+    /// How far a reduced-precision model's features are from the fp32 reference on the same superpixels
+    struct FeatureDrift {
+        size_t rows = 0;
+        double max_abs = 0, mean_abs = 0;
+        /// max_abs over the largest reference magnitude
+        double max_relative = 0;
+        double min_cosine = 1, mean_cosine = 1;
+
+        void Print(std::ostream &os) const;
+    };
+
+    /// Compare `rows` feature vectors of `dim` floats, row by row
+    FeatureDrift ComputeFeatureDrift(const float *reference, const float *features, size_t rows, int dim);
+
+    class IComputeFrame {
+    public:
+        virtual void Compute(cv::InputArray frame) = 0;
+    };
+
+    class IComputeFrameSuperpixel {
+    public:
+        virtual IComputeFrameSuperpixel* Compute(cv::InputArray frame, cv::InputArray superpixels) = 0;
+        virtual int GetFeatureDim() const = 0;
+        virtual int GetNSP() const = 0;
+        virtual void GetFeature(float *output_array) const = 0;
+        virtual void GetFeature(int superpixel_id, float *output_array) const = 0;
+
+        /// Max number of frames per ComputeBatch call
+        virtual int GetBatchSize() const { return 1; }
+
+        /// Run up to GetBatchSize() frames at once; features of frame i are read with GetBatchFeature(i, ...).
+        /// With SharesTrunk(), `superpixels` may hold k label maps per frame, frame-major (frame i owns
+        /// superpixels[i * k, i * k + k)): the trunk runs once per frame and feature blocks are then indexed by label map.
+        virtual IComputeFrameSuperpixel* ComputeBatch(const std::vector<cv::Mat> &frames,
+                                                      const std::vector<cv::Mat> &superpixels) {
+            CV_Assert(frames.size() == 1 && superpixels.size() == 1);
+            return Compute(frames[0], superpixels[0]);
+        }
+
+        /// Whether ComputeBatch pools several label maps per frame (e.g. superpixel size classes) from one trunk pass
+        virtual bool SharesTrunk() const { return false; }
+
+        /// GetFeatureDim() * GetNSP() floats for one frame (label map) of the last batch
+        virtual void GetBatchFeature(int batch_id, float *output_array) const {
+            CV_Assert(batch_id == 0);
+            GetFeature(output_array);
+        }
+
+        /// Gather only the requested superpixels (ids < GetNSP()), ids.size() * GetFeatureDim() floats in the order given
+        virtual void GetBatchFeatures(int batch_id, const std::vector<int> &ids, float *output_array) const {
+            CV_Assert(batch_id == 0);
+            for (size_t i = 0; i < ids.size(); ++i)
+                GetFeature(ids[i], output_array + i * GetFeatureDim());
+        }
+
+        void GetFeatures(const std::vector<int> &ids, float *output_array) const {
+            GetBatchFeatures(0, ids, output_array);
+        }
+
+        virtual ~IComputeFrameSuperpixel() {}
+    };
+
+    /// Conv trunk over an RGB image of any size, so a frame can be run fully convolutionally
+    class IComputeFeatureMap {
+    public:
+        /// Channels-last feature map of `frame`, whose sides are multiples of GetFeatureStride().
+        /// The map stays valid until the next call.
+        virtual bool ComputeFeatureMap(cv::InputArray frame, FeatureMap &output) = 0;
+
+        /// Input pixels per feature cell
+        virtual int GetFeatureStride() const = 0;
+
+        virtual ~IComputeFeatureMap() {}
+    };
+
+    /// Feature map of a whole frame, computed once from tiles with receptive-field halos.
+    /// Overlapping chips then pool from crops of it (SuperpixelPooling with an origin) instead of each running
+    /// the trunk again, which saves about the chip overlap factor in conv FLOPs.
+    class TiledFeatureMap {
+    public:
+        /// tile_size and halo are in input pixels and are rounded up to multiples of the trunk's stride.
+        /// A trunk shared between threads is locked with `trunk_mutex` around each tile.
+        explicit TiledFeatureMap(IComputeFeatureMap *trunk, int tile_size = 1024, int halo = 128,
+                                 std::mutex *trunk_mutex = nullptr);
+
+        /// Run the trunk over an RGB frame tile by tile; cells near tile borders see the halo, not zero padding
+        bool Compute(cv::InputArray frame);
+
+        /// Cell (x, y) covers frame pixels [x, x + 1) * stride by [y, y + 1) * stride
+        FeatureMap GetFeatureMap() const;
+
+        int GetStride() const;
+
+    protected:
+        IComputeFeatureMap *trunk;
+        int tile_size, halo;
+        std::mutex *trunk_mutex;
+        int channels = 0;
+        cv::Mat features, padded;
+    };
+
+    /// VGG16 trunk (ONNX or TF frozen graph) on cv::dnn's CPU backend with superpixel pooling in C++,
+    /// for nodes built without TensorFlow
+    class OpenCVVGG16SP : public IComputeFrameSuperpixel, public IComputeFeatureMap {
+    public:
+        /// An empty model path loads MODEL_WEIGHTS "vgg16.onnx"; an empty layer pools the network's output.
+        /// The trunk should end at a conv/pool layer (NCHW output).
+        /// INT8 loads the model's ModelVariant() (a QDQ-quantized ONNX); FP16 runs the fp32 model on cv::dnn's
+        /// CPU_FP16 target where OpenCV has one (4.9+, ARM; other CPUs fall back to fp32).
+        explicit OpenCVVGG16SP(const std::string &model_path = "", const std::string &output_layer = "",
+                               int pooling_modes = SuperpixelPooling::Average, unsigned int nsp = 1024,
+                               Precision precision = Precision::FP32);
+
+        bool Loaded() const;
+
+        void SetInputResolution(unsigned int width, unsigned int height, unsigned int batch_size = 1);
+
+        /// Hypercolumns: pool several layers from one forward pass and concatenate their features per superpixel,
+        /// in the order given. ComputeFeatureMap() returns the first one.
+        void SetOutputLayers(const std::vector<std::string> &layers);
+
+        IComputeFrameSuperpixel* Compute(cv::InputArray frame, cv::InputArray superpixels) override;
+
+        IComputeFrameSuperpixel* ComputeBatch(const std::vector<cv::Mat> &frames,
+                                              const std::vector<cv::Mat> &superpixels) override;
+
+        int GetFeatureDim() const override;
+
+        int GetNSP() const override;
+
+        int GetBatchSize() const override;
+
+        bool SharesTrunk() const override;
+
+        void GetFeature(float *output_array) const override;
+
+        void GetFeature(int superpixel_id, float *output_array) const override;
+
+        void GetBatchFeature(int batch_id, float *output_array) const override;
 
+        void GetBatchFeatures(int batch_id, const std::vector<int> &ids, float *output_array) const override;
+
+        bool ComputeFeatureMap(cv::InputArray frame, FeatureMap &output) override;
+
+        int GetFeatureStride() const override;
+
+        /// Time the input, forward and pooling stages of each batch, and each layer from cv::dnn's perf profile
+        void SetProfiler(std::shared_ptr<Profiler> profiler);
+
+        /// Input normalization, Keras VGG16 ("caffe" mode) by default: RGB frames become mean-subtracted BGR.
+        /// blobFromImage swaps the mean along with the channels, so it is given in the output (BGR) order.
+        double scale = 1.0;
+        cv::Scalar mean = cv::Scalar(103.939, 116.779, 123.68);
+        bool swap_rb = true;
+        /// Input pixels per cell of the (first) output layer (32 for VGG16 block5_pool)
+        int feature_stride = 32;
+
+    protected:
+        cv::dnn::Net net;
+        std::vector<std::string> output_layers;
+        SuperpixelPooling pooling;
+        unsigned int nsp;
+        unsigned int width = 256, height = 256, batch_size = 1;
+        /// per output layer, known after the first batch
+        std::vector<int> channels = {512};
+        cv::Mat blob, feature_map;
+        std::vector<cv::Mat> outputs;
+        std::vector<float> pooled_features;
+        cv::Mat tile_blob, tile_output, tile_feature_map;
+        std::shared_ptr<Profiler> profiler;
+        std::vector<double> layer_ticks;
+    };
+}
+
+#ifdef HAS_TF
 namespace spt::dnn {
     class TensorFlowInference {
     public:
@@ -18,31 +215,72 @@ namespace spt::dnn {
 
         TensorFlowInference(std::string const &graph_path);
 
+        /// Run on a session owned elsewhere (e.g. a SessionPool); the graph is not loaded again
+        explicit TensorFlowInference(tensorflow::Session *session);
+
         virtual ~TensorFlowInference();
 
         virtual bool NewSession();
         virtual bool NewSession(const tensorflow::SessionOptions &config);
 
+        /// Prints the graph's nodes, then the profile if one is set
         virtual void Summary();
 
+        /// Trace every run (RunOptions FULL_TRACE) into `profiler`, per op type and per layer from the step stats.
+        /// Set it before the callables are made (SetInputResolution, SetPooling); tracing slows the runs down.
+        void SetProfiler(std::shared_ptr<Profiler> profiler);
+
         // virtual void Compute(cv::InputArray frame) {}
 
     protected:
         bool _loaded;
-    };
+        bool _owns_session = true;
 
-    class IComputeFrame {
-    public:
-        virtual void Compute(cv::InputArray frame) = 0;
+        typedef tensorflow::Session::CallableHandle CallableHandle;
+        static constexpr CallableHandle NoCallable = -1;
+        /// Handles made on `session` and not yet released; the destructor releases them
+        std::vector<CallableHandle> callables;
+
+        /// Resolve feed and fetch names once so that RunCallable() skips the per-Run graph lookup.
+        /// A valid `handle` is released first; it is NoCallable on failure.
+        bool MakeCallable(const std::vector<std::string> &feeds, const std::vector<std::string> &fetches,
+                          CallableHandle &handle);
+
+        void ReleaseCallable(CallableHandle &handle);
+
+        /// session->RunCallable(), collecting the run's step stats when profiling
+        tensorflow::Status RunCallable(CallableHandle handle, const std::vector<tensorflow::Tensor> &feeds,
+                                       std::vector<tensorflow::Tensor> *fetches);
+
+        std::shared_ptr<Profiler> profiler;
     };
 
-    class IComputeFrameSuperpixel {
+    /// K sessions created from one loaded GraphDef, each with its own thread pools.
+    /// Several narrow sessions usually keep a many-core CPU busier than one wide session.
+    class SessionPool {
     public:
-        virtual IComputeFrameSuperpixel* Compute(cv::InputArray frame, cv::InputArray superpixels) = 0;
-        virtual int GetFeatureDim() const = 0;
-        virtual int GetNSP() const = 0;
-        virtual void GetFeature(float *output_array) const = 0;
-        virtual void GetFeature(int superpixel_id, float *output_array) const = 0;
+        struct Options {
+            int num_sessions = 1;
+            int intra_op_threads = 0; // 0 lets TensorFlow decide
+            int inter_op_threads = 0;
+            double gpu_memory_fraction = 0; // per session; 0 keeps the default
+        };
+
+        SessionPool(const tensorflow::GraphDef &graph, const Options &options);
+
+        ~SessionPool();
+
+        SessionPool(const SessionPool &) = delete;
+
+        SessionPool &operator=(const SessionPool &) = delete;
+
+        /// Number of sessions that were created successfully
+        size_t size() const;
+
+        tensorflow::Session *operator[](size_t i) const;
+
+    protected:
+        std::vector<tensorflow::Session *> sessions;
     };
 
     class VGG16 : public TensorFlowInference, public IComputeFrame {
@@ -51,32 +289,98 @@ namespace spt::dnn {
 
         void SetInputResolution(unsigned int width, unsigned int height);
 
+        /// Nodes fetched by Compute(), all in one Run (block5_pool by default)
+        void SetOutputNodes(const std::vector<std::string> &nodes);
+
         void Compute(cv::InputArray frame) override;
 
+        /// One tensor per output node, from the last Compute()
+        const std::vector<tensorflow::Tensor> &GetOutputs() const;
+
     protected:
+        std::vector<std::string> output_nodes = {"DCNN/block5_pool/MaxPool:0"};
         tensorflow::TensorShape input_shape;
         tensorflow::Tensor input_tensor;
         std::vector<std::pair<std::string, tensorflow::Tensor>> inputs;
         std::vector<tensorflow::Tensor> outputs;
+        CallableHandle callable = NoCallable;
     };
 
-    class VGG16SP : public TensorFlowInference, public IComputeFrameSuperpixel {
+    class VGG16SP : public TensorFlowInference, public IComputeFrameSuperpixel, public IComputeFeatureMap {
     public:
         VGG16SP();
 
-        void SetInputResolution(unsigned int width, unsigned int height);
+        /// Load another frozen graph with the same input and output nodes, e.g. an fp16 or int8 ModelVariant().
+        /// Half outputs are converted to float after each run.
+        explicit VGG16SP(const std::string &graph_path);
+
+        explicit VGG16SP(tensorflow::Session *session);
+
+        /// Fix the input tensors at {batch_size, height, width, ...}; smaller batches are fed as a slice.
+        /// Feeds and fetches are resolved into a callable here (and on SetPooling) instead of on every Run.
+        void SetInputResolution(unsigned int width, unsigned int height, unsigned int batch_size = 1);
+
+        /// Fetch a conv feature map (e.g. "DCNN/block5_pool/MaxPool:0") and pool it per superpixel in C++ instead of
+        /// running the graph's one-hot Superpixels/MatMul; frames may then have up to `nsp` superpixels.
+        /// `modes` combines SuperpixelPooling::Mode flags. An empty node name restores in-graph pooling.
+        /// `stride` is the node's input pixels per cell (32 for block5_pool), used by ComputeFeatureMap().
+        void SetPooling(const std::string &feature_node, int modes = SuperpixelPooling::Average,
+                        unsigned int nsp = 1024, int stride = 32);
+
+        /// Hypercolumns: fetch several feature maps in one Run and concatenate their pooled features per superpixel,
+        /// in the order given. `stride` refers to the first node, the one ComputeFeatureMap() returns.
+        void SetPooling(const std::vector<std::string> &feature_nodes, int modes = SuperpixelPooling::Average,
+                        unsigned int nsp = 1024, int stride = 32);
 
         IComputeFrameSuperpixel* Compute(cv::InputArray frame, cv::InputArray superpixels) override;
 
+        IComputeFrameSuperpixel* ComputeBatch(const std::vector<cv::Mat> &frames,
+                                              const std::vector<cv::Mat> &superpixels) override;
+
+        /// Read off the output tensors' shapes, summed over pooled nodes; 512 per node until the first Run
         int GetFeatureDim() const override;
 
+        /// Max number of superpixels per frame, read off the output tensor's shape (300 until the first Run),
+        /// or the capacity given to SetPooling()
         int GetNSP() const override;
 
+        int GetBatchSize() const override;
+
+        /// Only with C++ pooling (SetPooling); in-graph pooling takes one label map per frame
+        bool SharesTrunk() const override;
+
+        /// Features of the first frame in the last batch
         void GetFeature(float *output_array) const override;
 
         void GetFeature(int superpixel_id, float *output_array) const override;
 
+        void GetBatchFeature(int batch_id, float *output_array) const override;
+
+        void GetBatchFeatures(int batch_id, const std::vector<int> &ids, float *output_array) const override;
+
+        /// Feed one image of its own size and fetch the SetPooling() node; needs a graph whose input image
+        /// placeholder has free spatial dimensions
+        bool ComputeFeatureMap(cv::InputArray frame, FeatureMap &output) override;
+
+        int GetFeatureStride() const override;
+
     protected:
+        unsigned int width = 0, height = 0, batch_size = 1;
+        std::vector<std::string> output_nodes = {"Superpixels/MatMul:0"};
+        std::unique_ptr<SuperpixelPooling> pooling;
+        unsigned int pooling_nsp = 0;
+        int pooling_stride = 32;
+        tensorflow::Tensor tile_tensor;
+        std::vector<tensorflow::Tensor> tile_outputs;
+        /// batch feeds and fetches for the current pooling mode, and the image-only fetch of ComputeFeatureMap()
+        CallableHandle callable = NoCallable, tile_callable = NoCallable;
+        std::vector<tensorflow::Tensor> feeds;
+
+        void make_callables();
+        std::vector<float> pooled_features;
+
+        /// {batch, NSP, feature} block of the last batch, from the graph or from C++ pooling
+        const float *feature_data() const;
         tensorflow::TensorShape input_shape;
         tensorflow::Tensor input_tensor;
         tensorflow::TensorShape superpixel_shape;
@@ -0,0 +1,45 @@
+#ifndef __HIERARCHY_HPP__
+#define __HIERARCHY_HPP__
+#include <vector>
+#include <opencv2/core.hpp>
+#include "superpixel.hpp"
+
+namespace spt {
+    /// Compute per-superpixel mean color and area from a frame (CV_8UC3 or CV_32FC3, in the color space the
+    /// stats should be in) and its label map in a single pass
+    void ComputeRegionInfo(cv::InputArray frame, cv::InputArray labels, unsigned int nsp, std::vector<RegionInfo> &output);
+
+    /// Greedy agglomerative merging of adjacent superpixels.
+    /// Compute() records the full sequence of merges once; GetLabels() then replays a prefix of it
+    /// to produce a label map at any granularity without re-running the segmentation.
+    class RegionHierarchy {
+    public:
+        struct Merge {
+            int into, from;
+            float cost;
+        };
+
+        RegionHierarchy() {}
+
+        /// Build the hierarchy from a CV_32SC1 label map and per-label statistics (indexed by label)
+        RegionHierarchy *Compute(cv::InputArray labels, const std::vector<RegionInfo> &regions);
+
+        /// Label map with (at most) `num_regions` contiguous labels; returns the actual number of regions
+        unsigned int GetLabels(unsigned int num_regions, cv::OutputArray output) const;
+
+        /// Number of superpixels present in the label map, i.e. the finest level
+        unsigned int GetNumSuperpixels() const;
+
+        const std::vector<Merge> &GetMerges() const;
+
+    protected:
+        cv::Mat leaf_labels;
+        unsigned int num_leaves = 0, num_present = 0;
+        std::vector<Merge> merges;
+
+        /// Ward's criterion: increase of the within-region squared error when merging
+        static float cost(const RegionInfo &a, const RegionInfo &b);
+    };
+}
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef __INFERENCE_HPP__
+#define __INFERENCE_HPP__
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "dcnn.hpp"
+
+namespace spt::dnn {
+    /// Features of one frame, superpixel-major: one GetFeatureDim() row per requested superpixel
+    typedef std::vector<float> FeatureBlock;
+
+    /// Dynamic batching in front of an IComputeFrameSuperpixel.
+    /// Workers Submit() frames from any thread; an executor thread gathers queued requests into batches of
+    /// up to max_batch_size, waiting at most max_wait after the oldest request for a batch to fill, and completes
+    /// each request's future with its own feature block.
+    /// With several model instances (e.g. one per pooled session) each gets an executor on the same queue.
+    class InferenceService {
+    public:
+        struct Metrics {
+            unsigned long requests = 0, batches = 0, failed = 0;
+            size_t max_queue_depth = 0;
+            /// batch_sizes[n] = number of batches that ran n frames
+            std::vector<unsigned long> batch_sizes;
+
+            double MeanBatchSize() const;
+
+            void Print(std::ostream &os) const;
+        };
+
+        /// The model must outlive the service and is only used from its executor thread from here on.
+        /// max_batch_size is capped at model->GetBatchSize().
+        InferenceService(IComputeFrameSuperpixel *model, int max_batch_size, std::chrono::microseconds max_wait);
+
+        /// Models must be interchangeable (same graph and input resolution)
+        InferenceService(const std::vector<IComputeFrameSuperpixel *> &models, int max_batch_size,
+                         std::chrono::microseconds max_wait);
+
+        /// Completes everything already queued, then joins the executors
+        ~InferenceService();
+
+        InferenceService(const InferenceService &) = delete;
+
+        InferenceService &operator=(const InferenceService &) = delete;
+
+        /// Queue one frame (RGB) and its CV_32SC1 label map. The Mats are not copied and must stay unchanged until
+        /// the future is ready. Only the rows of `ids` (all GetNSP() rows if empty) are returned, in that order;
+        /// ids outside [0, GetNSP()) fail only this request. Failed inference surfaces as an exception from
+        /// future::get().
+        std::future<FeatureBlock> Submit(const cv::Mat &frame, const cv::Mat &superpixels,
+                                         std::vector<int> ids = std::vector<int>());
+
+        /// Several label maps of one frame (e.g. superpixel size classes) pooled from a single trunk pass, one block
+        /// per label map with the rows of ids[j]. Needs models that SharesTrunk() unless there is one label map.
+        /// Batches only group requests with the same number of label maps.
+        std::future<std::vector<FeatureBlock>> Submit(const cv::Mat &frame, const std::vector<cv::Mat> &label_maps,
+                                                      std::vector<std::vector<int>> ids);
+
+        /// Model output shape as of the last completed batch (the model's defaults before the first one)
+        int GetFeatureDim() const;
+
+        int GetNSP() const;
+
+        int GetMaxBatchSize() const;
+
+        size_t GetQueueDepth() const;
+
+        Metrics GetMetrics() const;
+
+    protected:
+        struct Request {
+            cv::Mat frame;
+            std::vector<cv::Mat> superpixels;
+            std::vector<std::vector<int>> ids;
+            std::promise<std::vector<FeatureBlock>> promise;
+            std::chrono::steady_clock::time_point arrival;
+        };
+
+        std::vector<IComputeFrameSuperpixel *> models;
+        const int max_batch_size;
+        const std::chrono::microseconds max_wait;
+
+        mutable std::mutex mutex;
+        std::condition_variable queue_cv;
+        std::deque<Request> queue;
+        bool stopping = false;
+        int feature_dim, nsp;
+        Metrics metrics;
+        std::vector<std::thread> executors;
+
+        void run(IComputeFrameSuperpixel *model);
+    };
+}
+
+#endif
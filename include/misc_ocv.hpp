@@ -28,6 +28,11 @@ namespace cv_misc {
     std::vector<CameraInfo> camera_enumerate2();
     std::string type2str(int type);
 
+    /// Nearest-neighbor resize of a CV_32SC1 label map, sampling the same pixels as cv::resize with INTER_NEAREST
+    /// but gathering rows with SIMD instead of its generic per-element path. Writes in place if `output` already has
+    /// the target size.
+    void ResizeNearestLabels(cv::InputArray input, cv::OutputArray output, cv::Size size);
+
     struct Chipping {
         int width, height;
         int chip_width, chip_height;
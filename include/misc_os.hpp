@@ -134,4 +134,75 @@ namespace os_misc {
         IPCSem _sem;
     };
 }
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace os_misc {
+    constexpr uint64_t FNV1aOffset = 14695981039346656037ull;
+
+    /// 64-bit FNV-1a; pass the previous result as `hash` to hash several fields as one key
+    uint64_t FNV1a(const void *data, size_t size, uint64_t hash = FNV1aOffset);
+
+    /// FNV-1a of a file's content, read through a private mapping; 0 if it cannot be read
+    uint64_t HashFile(const char *path);
+
+    /// Append-only file of keyed binary records, read in place through mmap. Keys are hashed into an in-memory
+    /// index on Open(); the latest record of a key wins and a torn tail (crash mid-append) is dropped.
+    /// Threads share one store; processes may append to the same file (flock), each seeing the others' records
+    /// from its next append on. Record data is 8-byte aligned in the mapping.
+    class RecordStore {
+    public:
+        RecordStore() {}
+
+        ~RecordStore();
+
+        RecordStore(const RecordStore &) = delete;
+
+        RecordStore &operator=(const RecordStore &) = delete;
+
+        /// Open or create the file; read-only stores never create, truncate or append
+        bool Open(const std::string &path, bool writable = true);
+
+        void Close();
+
+        bool IsOpen() const;
+
+        /// `data` points into the mapping and stays valid until Close()
+        bool Find(const std::string &key, const void *&data, size_t &size);
+
+        bool Append(const std::string &key, const void *data, size_t size);
+
+        /// Number of records indexed, superseded ones included
+        size_t size() const;
+
+    protected:
+        struct RecordHeader {
+            uint32_t magic;
+            uint32_t key_size;
+            uint64_t data_size;
+            uint64_t hash;
+        };
+
+        int fd = -1;
+        bool writable = false;
+        mutable std::mutex mutex;
+        /// key hash -> record offsets, oldest first
+        std::unordered_map<uint64_t, std::vector<uint64_t>> index;
+        size_t records = 0;
+        /// end of the last valid record
+        uint64_t end = 0;
+        const char *map = nullptr;
+        size_t map_size = 0;
+        /// earlier, smaller mappings; pointers handed out by Find() may still be in them
+        std::vector<std::pair<const char *, size_t>> retired;
+
+        bool remap(uint64_t size);
+
+        /// Index the records in [end, to) and advance `end` past the last complete one
+        void scan(uint64_t to);
+    };
+}
 #endif //GLOWING_ENIGMA_MISC_OS_HPP
@@ -0,0 +1,54 @@
+#ifndef __POOLING_HPP__
+#define __POOLING_HPP__
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace spt::dnn {
+    /// Feature map of one frame, channels-last (HWC) and contiguous, as TensorFlow lays out conv outputs
+    struct FeatureMap {
+        const float *data = nullptr;
+        int height = 0, width = 0, channels = 0;
+
+        const float *at(int y, int x) const {
+            return data + ((size_t) y * width + x) * channels;
+        }
+    };
+
+    /// Per-superpixel pooling of a conv feature map in C++, replacing a dense one-hot matmul in the graph.
+    /// Every label-map pixel is mapped to the feature cell it falls in (nearest neighbor), so a superpixel's
+    /// average weighs each cell by the number of its pixels in it, and its max runs over every cell it touches.
+    class SuperpixelPooling {
+    public:
+        enum Mode {
+            Average = 1,
+            Max = 2
+        };
+
+        /// `modes` is a combination of Mode flags; with several, their features are concatenated per superpixel
+        explicit SuperpixelPooling(int modes = Average);
+
+        int GetFeatureDim(int channels) const;
+
+        /// Pool over a CV_32SC1 label map of any resolution; labels outside [0, nsp) are ignored.
+        /// Writes nsp rows of GetFeatureDim(channels) floats; superpixels without pixels get zeros.
+        /// Rows start `output_step` floats apart (0: packed), so several layers can be concatenated per superpixel.
+        void Compute(const FeatureMap &features, cv::InputArray labels, unsigned int nsp, float *output,
+                     size_t output_step = 0);
+
+        /// Pool a crop of a larger feature map, e.g. a chip's labels over the feature map of its whole frame:
+        /// label pixel (x, y) falls into cell ((origin.x + x) / stride, (origin.y + y) / stride)
+        void Compute(const FeatureMap &features, cv::InputArray labels, cv::Point origin, int stride,
+                     unsigned int nsp, float *output, size_t output_step = 0);
+
+        int modes;
+
+    protected:
+        std::vector<int> counts, xofs, yofs;
+
+        /// Accumulate with the label-to-cell maps in xofs/yofs
+        void pool(const FeatureMap &features, const cv::Mat &labels, unsigned int nsp, float *output,
+                  size_t output_step);
+    };
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef __PROFILER_HPP__
+#define __PROFILER_HPP__
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace spt::dnn {
+    /// Timings aggregated across runs: graph nodes per op type and per layer (e.g. from TF step stats), and the
+    /// C++ stages around them (input copies, the run itself, pooling). Thread-safe, so model replicas can share one.
+    class Profiler {
+    public:
+        struct Timing {
+            unsigned long count = 0;
+            double total_micros = 0, max_micros = 0;
+
+            void Add(double micros);
+        };
+
+        /// Times a stage from construction to destruction; a null profiler makes it a no-op
+        class Scope {
+        public:
+            Scope(Profiler *profiler, const char *stage);
+
+            ~Scope();
+
+            Scope(const Scope &) = delete;
+
+            Scope &operator=(const Scope &) = delete;
+
+        protected:
+            Profiler *profiler;
+            const char *stage;
+            int64_t start_micros;
+            std::chrono::steady_clock::time_point start;
+        };
+
+        /// Trace events beyond `max_events` are aggregated but not kept for the Chrome trace
+        explicit Profiler(size_t max_events = 200000);
+
+        /// Microseconds since the epoch, the clock of TF's step stats; trace events start on it
+        static int64_t NowMicros();
+
+        /// One executed node; the layer is the node name up to its last '/'
+        void AddNode(const std::string &node, const std::string &op, const std::string &device, uint64_t thread,
+                     int64_t start_micros, int64_t duration_micros);
+
+        /// One stage run by the calling thread
+        void AddStage(const std::string &stage, int64_t start_micros, int64_t duration_micros);
+
+        /// Stages, then the `top` most expensive op types and layers
+        void Print(std::ostream &os, size_t top = 20) const;
+
+        /// Chrome trace event format (chrome://tracing, Perfetto): one process per device, stages on "host"
+        bool WriteChromeTrace(const std::string &path) const;
+
+        bool Empty() const;
+
+    protected:
+        struct Event {
+            std::string name, category;
+            int device;
+            uint64_t thread;
+            int64_t start_micros, duration_micros;
+        };
+
+        mutable std::mutex mutex;
+        std::map<std::string, Timing> ops, layers, stages;
+        std::vector<std::string> devices;
+        std::vector<Event> events;
+        size_t max_events;
+
+        int device_index(const std::string &device);
+    };
+}
+
+#endif
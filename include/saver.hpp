@@ -1,6 +1,12 @@
 #ifndef __SAVER_HPP__
 #define __SAVER_HPP__
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <libpq-fe.h>
 
 extern "C" {
 #include "fpconv.h"
@@ -17,7 +23,7 @@ namespace spt::pgsaver {
         char *dst0 = dst;
         *dst++ = '{';
         do {
-            dst += dtoa_(static_cast<double>(*vec), dst);
+            dst += dtoa_(*vec, dst);
             *dst++ = ',';
             vec++;
         } while (--dim);
@@ -40,5 +46,280 @@ namespace spt::pgsaver {
         size_t len = vec2cstr(dim, vec.data()+offset, const_cast<char *>(dst.data()));
         dst.resize(len);
     }
+
+    /// Type oids (pg_type.dat) of the columns BinaryCopyWriter converts to
+    namespace oid {
+        constexpr Oid int8 = 20, int2 = 21, int4 = 23, text = 25, float4 = 700, float8 = 701, float4_array = 1021,
+                float8_array = 1022, varchar = 1043;
+    }
+
+    /// A one-dimensional array field, e.g. a feature row inside a block
+    template<typename F>
+    struct ArrayRef {
+        const F *data;
+        size_t size;
+    };
+
+    template<typename F>
+    ArrayRef<F> array_ref(const F *data, size_t size) {
+        return {data, size};
+    }
+
+    /// COPY ... FROM STDIN (FORMAT binary) stream: the PGCOPY signature, then per tuple its field count and each
+    /// field as a length and its value in network byte order; -1 ends it. Arrays are in array_recv's format.
+    class BinaryCopyBuffer {
+    public:
+        BinaryCopyBuffer() {
+            static const char signature[11] = {'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0'};
+            buffer.append(signature, sizeof(signature));
+            put32(0); // flags
+            put32(0); // header extension length
+        }
+
+        void BeginRow(int16_t num_fields) { put16(static_cast<uint16_t>(num_fields)); }
+
+        void Null() { put32(static_cast<uint32_t>(-1)); }
+
+        void Int2(int16_t v) { put32(2); put16(static_cast<uint16_t>(v)); }
+
+        void Int4(int32_t v) { put32(4); put32(static_cast<uint32_t>(v)); }
+
+        void Int8(int64_t v) { put32(8); put64(static_cast<uint64_t>(v)); }
+
+        void Float4(float v) { put32(4); put32(bits(v)); }
+
+        void Float8(double v) { put32(8); put64(bits(v)); }
+
+        void Text(const std::string &v) {
+            put32(static_cast<uint32_t>(v.size()));
+            buffer.append(v);
+        }
+
+        /// real[] when E is float, double precision[] when it is double; elements are converted from F
+        template<typename E, typename F>
+        void Array(const F *v, size_t dim) {
+            static_assert(std::is_same_v<E, float> || std::is_same_v<E, double>);
+            const Oid element = std::is_same_v<E, float> ? oid::float4 : oid::float8;
+            // ndim, has nulls and the element type, then size and lower bound of the only dimension;
+            // an empty array has no dimensions
+            const size_t header = dim > 0 ? 20 : 12;
+            put32(static_cast<uint32_t>(header + dim * (4 + sizeof(E))));
+            put32(dim > 0 ? 1 : 0);
+            put32(0);
+            put32(element);
+            if (dim > 0) {
+                put32(static_cast<uint32_t>(dim));
+                put32(1);
+            }
+            // elements are written in place, the array being most of the stream
+            size_t pos = buffer.size();
+            buffer.resize(pos + dim * (4 + sizeof(E)));
+            auto *dst = reinterpret_cast<unsigned char *>(&buffer[pos]);
+            for (size_t i = 0; i < dim; ++i) {
+                dst = store(dst, static_cast<uint32_t>(sizeof(E)));
+                dst = store(dst, bits(static_cast<E>(v[i])));
+            }
+        }
+
+        /// Trailer, after the last tuple
+        void End() { put16(static_cast<uint16_t>(-1)); }
+
+        const char *data() const { return buffer.data(); }
+
+        size_t size() const { return buffer.size(); }
+
+        /// Drops what has been sent; the stream goes on with the next tuple
+        void clear() { buffer.clear(); }
+
+    protected:
+        std::string buffer;
+
+        static uint32_t bits(float v) {
+            uint32_t u;
+            std::memcpy(&u, &v, sizeof(u));
+            return u;
+        }
+
+        static uint64_t bits(double v) {
+            uint64_t u;
+            std::memcpy(&u, &v, sizeof(u));
+            return u;
+        }
+
+        static unsigned char *store(unsigned char *dst, uint32_t v) {
+            dst[0] = static_cast<unsigned char>(v >> 24);
+            dst[1] = static_cast<unsigned char>(v >> 16);
+            dst[2] = static_cast<unsigned char>(v >> 8);
+            dst[3] = static_cast<unsigned char>(v);
+            return dst + 4;
+        }
+
+        static unsigned char *store(unsigned char *dst, uint64_t v) {
+            return store(store(dst, static_cast<uint32_t>(v >> 32)), static_cast<uint32_t>(v));
+        }
+
+        void put16(uint16_t v) {
+            const char b[2] = {static_cast<char>(v >> 8), static_cast<char>(v)};
+            buffer.append(b, 2);
+        }
+
+        void put32(uint32_t v) {
+            unsigned char b[4];
+            store(b, v);
+            buffer.append(reinterpret_cast<const char *>(b), 4);
+        }
+
+        void put64(uint64_t v) {
+            unsigned char b[8];
+            store(b, v);
+            buffer.append(reinterpret_cast<const char *>(b), 8);
+        }
+    };
+
+    /// Binary COPY into `table` over a libpq connection of its own, in place of pqxx::stream_to and vec2str:
+    /// features go from float buffers to the wire with no text on either end. Values are converted to the types of
+    /// their columns, looked up when the copy starts; errors throw std::runtime_error, like pqxx's.
+    class BinaryCopyWriter {
+    public:
+        BinaryCopyWriter(const std::string &conninfo, const std::string &table, const std::vector<std::string> &columns,
+                         size_t flush_bytes = 1 << 20) : flush_bytes(flush_bytes) {
+            conn = PQconnectdb(conninfo.c_str());
+            try {
+                start(table, columns);
+            }
+            catch (...) {
+                PQfinish(conn);
+                throw;
+            }
+        }
+
+        /// A copy that was not completed is aborted, and nothing it wrote is kept
+        ~BinaryCopyWriter() {
+            if (in_copy) {
+                PQputCopyEnd(conn, "aborted");
+                while (PGresult *r = PQgetResult(conn)) PQclear(r);
+            }
+            PQfinish(conn);
+        }
+
+        BinaryCopyWriter(const BinaryCopyWriter &) = delete;
+
+        BinaryCopyWriter &operator=(const BinaryCopyWriter &) = delete;
+
+        /// One value per column: integers, floating point, std::string, or ArrayRef for arrays
+        template<typename... T>
+        void WriteRow(const T &... values) {
+            if (sizeof...(values) != types.size())
+                throw std::runtime_error("COPY row has " + std::to_string(sizeof...(values)) + " values for " +
+                                         std::to_string(types.size()) + " columns");
+            buffer.BeginRow(static_cast<int16_t>(sizeof...(values)));
+            size_t i = 0;
+            (put(i++, values), ...);
+            ++rows;
+            if (buffer.size() >= flush_bytes) flush();
+        }
+
+        /// Ends the copy; the rows are in the table once this returns
+        void complete() {
+            buffer.End();
+            flush();
+            in_copy = false;
+            if (PQputCopyEnd(conn, nullptr) != 1) fail("Cannot end the copy");
+            bool ok = true;
+            std::string message;
+            while (PGresult *r = PQgetResult(conn)) {
+                if (PQresultStatus(r) != PGRES_COMMAND_OK) {
+                    ok = false;
+                    message = PQresultErrorMessage(r);
+                }
+                PQclear(r);
+            }
+            if (!ok) throw std::runtime_error("COPY failed: " + message);
+        }
+
+        unsigned long GetRows() const { return rows; }
+
+    protected:
+        PGconn *conn = nullptr;
+        std::vector<Oid> types;
+        BinaryCopyBuffer buffer;
+        size_t flush_bytes;
+        unsigned long rows = 0;
+        bool in_copy = false;
+
+        void start(const std::string &table, const std::vector<std::string> &columns) {
+            if (PQstatus(conn) != CONNECTION_OK) fail("Cannot connect");
+            for (auto const &column: columns) {
+                const char *params[2] = {table.c_str(), column.c_str()};
+                PGresult *r = PQexecParams(conn,
+                                           "select atttypid from pg_attribute where attrelid = $1::regclass "
+                                           "and attname = $2 and not attisdropped",
+                                           2, nullptr, params, nullptr, nullptr, 0);
+                const bool found = PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) == 1;
+                if (found) types.push_back(static_cast<Oid>(std::stoul(PQgetvalue(r, 0, 0))));
+                PQclear(r);
+                if (!found) fail("Cannot find column " + table + "." + column);
+            }
+            std::string sql = "copy " + table + " (";
+            for (size_t i = 0; i < columns.size(); ++i)
+                sql += (i ? ", " : "") + columns[i];
+            sql += ") from stdin (format binary)";
+            PGresult *r = PQexec(conn, sql.c_str());
+            const bool copying = PQresultStatus(r) == PGRES_COPY_IN;
+            PQclear(r);
+            if (!copying) fail("Cannot start the copy into " + table);
+            in_copy = true;
+        }
+
+        [[noreturn]] void fail(const std::string &what) {
+            throw std::runtime_error(what + ": " + PQerrorMessage(conn));
+        }
+
+        void flush() {
+            if (buffer.size() == 0) return;
+            if (PQputCopyData(conn, buffer.data(), static_cast<int>(buffer.size())) != 1) fail("Cannot send COPY data");
+            buffer.clear();
+        }
+
+        [[noreturn]] void mismatch(size_t i, const char *value) {
+            throw std::runtime_error("Cannot write " + std::string(value) + " into column " + std::to_string(i) +
+                                     " of type oid " + std::to_string(types[i]));
+        }
+
+        template<typename V>
+        std::enable_if_t<std::is_integral_v<V>> put(size_t i, V v) {
+            switch (types[i]) {
+                case oid::int2: buffer.Int2(static_cast<int16_t>(v)); break;
+                case oid::int4: buffer.Int4(static_cast<int32_t>(v)); break;
+                case oid::int8: buffer.Int8(static_cast<int64_t>(v)); break;
+                case oid::float4: buffer.Float4(static_cast<float>(v)); break;
+                case oid::float8: buffer.Float8(static_cast<double>(v)); break;
+                default: mismatch(i, "an integer");
+            }
+        }
+
+        template<typename V>
+        std::enable_if_t<std::is_floating_point_v<V>> put(size_t i, V v) {
+            switch (types[i]) {
+                case oid::float4: buffer.Float4(static_cast<float>(v)); break;
+                case oid::float8: buffer.Float8(static_cast<double>(v)); break;
+                default: mismatch(i, "a float");
+            }
+        }
+
+        void put(size_t i, const std::string &v) {
+            if (types[i] != oid::text && types[i] != oid::varchar) mismatch(i, "a string");
+            buffer.Text(v);
+        }
+
+        template<typename F>
+        void put(size_t i, const ArrayRef<F> &v) {
+            switch (types[i]) {
+                case oid::float4_array: buffer.Array<float>(v.data, v.size); break;
+                case oid::float8_array: buffer.Array<double>(v.data, v.size); break;
+                default: mismatch(i, "an array");
+            }
+        }
+    };
 }
 #endif
@@ -0,0 +1,40 @@
+#ifndef __SEGCACHE_HPP__
+#define __SEGCACHE_HPP__
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "superpixel.hpp"
+#include "misc_os.hpp"
+
+namespace spt {
+    /// Settings part of a segmentation cache key: whatever decides the label map besides the pixels. Backends map
+    /// a config onto their settings in one way (SuperpixelRegistry, GSLICSettings), so every tool keys alike.
+    std::string SegmentationSettings(const std::string &backend, const SuperpixelConfig &config);
+
+    /// Segmentations on disk, shared across runs and tools: run-length encoded label maps with their superpixel
+    /// count and, optionally, region stats, in an os_misc::RecordStore. Entries are decoded straight off the mapping.
+    class SegmentationCache {
+    public:
+        SegmentationCache() {}
+
+        bool Open(const std::string &path, bool writable = true);
+
+        bool IsOpen() const;
+
+        /// `image_hash` is the content hash of the whole image (os_misc::HashFile), `roi` the segmented crop
+        static std::string Key(uint64_t image_hash, const cv::Rect &roi, const std::string &settings);
+
+        /// Labels, contour and superpixel count; `regions` receives the stats if they were stored
+        bool Load(const std::string &key, SegmentationResult &result, std::vector<RegionInfo> *regions = nullptr);
+
+        bool Store(const std::string &key, const cv::Mat &labels, unsigned int num_superpixels,
+                   const std::vector<RegionInfo> *regions = nullptr);
+
+        size_t size() const;
+
+    protected:
+        os_misc::RecordStore store;
+    };
+}
+
+#endif
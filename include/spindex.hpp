@@ -0,0 +1,44 @@
+#ifndef __SPINDEX_HPP__
+#define __SPINDEX_HPP__
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace spt {
+    /// Inverted index from superpixel label to the raster offsets of its pixels (CSR layout),
+    /// built by counting sort in two linear passes over the label map.
+    /// Per-superpixel queries then cost O(area) instead of a full-frame mask each.
+    class SuperpixelIndex {
+    public:
+        SuperpixelIndex() {}
+
+        /// Index a CV_32SC1 label map; nsp = 0 sizes the index by the largest label found
+        SuperpixelIndex *Compute(cv::InputArray labels, unsigned int nsp = 0);
+
+        unsigned int GetNumSuperpixels() const;
+
+        int GetArea(unsigned int superpixel_id) const;
+
+        /// Pixel offsets (y * cols + x) of a superpixel, in raster order
+        const int *begin(unsigned int superpixel_id) const;
+
+        const int *end(unsigned int superpixel_id) const;
+
+        cv::Rect GetBoundingRect(unsigned int superpixel_id) const;
+
+        /// Full-frame CV_8UC1 mask of a superpixel
+        void GetMask(unsigned int superpixel_id, cv::OutputArray output) const;
+
+        /// Mask cropped to the bounding rect grown by `padding` (clipped to the frame); `roi` receives the crop
+        void GetMask(unsigned int superpixel_id, cv::OutputArray output, cv::Rect &roi, int padding = 1) const;
+
+        /// Same as cv::meanStdDev with the superpixel as mask, for 8-bit frames of up to 4 channels
+        void MeanStdDev(cv::InputArray frame, unsigned int superpixel_id, cv::Scalar &mean, cv::Scalar &stddev) const;
+
+    protected:
+        cv::Size frame_size;
+        std::vector<int> offsets;
+        std::vector<int> pixels;
+    };
+}
+
+#endif
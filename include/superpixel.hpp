@@ -3,10 +3,33 @@
 #include <opencv2/core/utility.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/ximgproc.hpp>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <future>
+#include <mutex>
 #ifdef HAS_LIBGSLIC
 #include "gSLICr_Lib/gSLICr.h"
 #endif
 namespace spt {
+    /// Per-superpixel summary: mean color (in the color space used for segmentation) and pixel count
+    struct RegionInfo {
+        cv::Vec3f color;
+        float area = 0;
+    };
+
+    /// Draw a boundary mask for an arbitrary label map (same rule as gSLICr's boundary mask)
+    void GetLabelContour(cv::InputArray labels, cv::OutputArray output);
+
+    /// Output of one segmentation, detached from the segmenter so it stays valid while the next frame is computed
+    struct SegmentationResult {
+        cv::Mat labels;   // CV_32SC1
+        cv::Mat contour;  // CV_8UC1 boundary mask
+        unsigned int num_superpixels = 0;
+    };
+
     class ISuperpixel {
     public:
         virtual ISuperpixel *Compute(cv::InputArray frame) = 0;
@@ -17,14 +40,36 @@ namespace spt {
 
         virtual unsigned int GetNumSuperpixels() = 0;
 
+        /// Segment a copy of the frame on a background thread.
+        /// Async calls on the same object are serialized, so one segmenter can be shared between threads.
+        /// Results are recycled from a ring of buffers once every handle to them is released.
+        std::future<std::shared_ptr<const SegmentationResult>> ComputeAsync(cv::InputArray frame);
+
         virtual ~ISuperpixel() {}
+
+    protected:
+        struct AsyncSlot {
+            std::shared_ptr<SegmentationResult> result;
+            cv::Mat frame;
+        };
+
+        struct AsyncContext {
+            std::mutex compute_mutex, slot_mutex;
+            std::vector<AsyncSlot> slots;
+        };
+
+        static constexpr size_t num_async_buffers = 2;
+        std::shared_ptr<AsyncContext> async_context = std::make_shared<AsyncContext>();
     };
 
     class OpenCVSLIC : public ISuperpixel {
     public:
         OpenCVSLIC() {}
 
-        OpenCVSLIC(float superpixel_size, float ruler, unsigned int num_iter, float min_size);
+        /// In streaming mode intermediate buffers are kept across frames and the median blur and HSV
+        /// conversion run as one pass over row stripes, in parallel
+        OpenCVSLIC(float superpixel_size, float ruler, unsigned int num_iter, float min_size,
+                   int algorithm = cv::ximgproc::SLICO, bool streaming = false);
 
         ISuperpixel *Compute(cv::InputArray frame) override;
 
@@ -36,10 +81,101 @@ namespace spt {
 
         unsigned int num_iter;
         float superpixel_size, min_size, ruler;
+        int algorithm = cv::ximgproc::SLICO; // SLIC | SLICO | MSLIC
+        bool streaming = false;
         cv::Ptr<cv::ximgproc::SuperpixelSLIC> segmentation;
 
     protected:
         cv::Mat frame_hsv;
+        std::vector<cv::Mat> stripe_buffers;
+
+        void preprocess(const cv::Mat &frame);
+    };
+
+    /// SEEDS from opencv_ximgproc; the segmentation object is kept for as long as the frame size stays the same
+    class OpenCVSEEDS : public ISuperpixel {
+    public:
+        OpenCVSEEDS() {}
+
+        OpenCVSEEDS(unsigned int num_superpixels, unsigned int num_iter, int num_levels = 4, int prior = 2,
+                    int histogram_bins = 5);
+
+        ISuperpixel *Compute(cv::InputArray frame) override;
+
+        void GetContour(cv::OutputArray output) override;
+
+        void GetLabels(cv::OutputArray output) override;
+
+        unsigned int GetNumSuperpixels() override;
+
+        unsigned int num_superpixels, num_iter;
+        int num_levels, prior, histogram_bins;
+        cv::Ptr<cv::ximgproc::SuperpixelSEEDS> segmentation;
+
+    protected:
+        cv::Size frame_size;
+        cv::Mat frame_hsv;
+    };
+
+    /// Linear Spectral Clustering from opencv_ximgproc
+    class OpenCVLSC : public ISuperpixel {
+    public:
+        OpenCVLSC() {}
+
+        OpenCVLSC(float superpixel_size, float ratio, unsigned int num_iter, float min_size);
+
+        ISuperpixel *Compute(cv::InputArray frame) override;
+
+        void GetContour(cv::OutputArray output) override;
+
+        void GetLabels(cv::OutputArray output) override;
+
+        unsigned int GetNumSuperpixels() override;
+
+        unsigned int num_iter;
+        float superpixel_size, min_size, ratio;
+        cv::Ptr<cv::ximgproc::SuperpixelLSC> segmentation;
+
+    protected:
+        cv::Mat frame_lab;
+    };
+
+    /// CPU port of the gSLICr algorithm (grid-seeded SLIC with a 3x3 center search and local label suppression),
+    /// for nodes without CUDA. Follows GSLIC with seg_method = GIVEN_SIZE in CIELAB; labels index the seed grid.
+    class GSLICCPU : public ISuperpixel {
+    public:
+        GSLICCPU() {}
+
+        GSLICCPU(int spixel_size, int no_iters, float coh_weight, bool do_enforce_connectivity);
+
+        ISuperpixel *Compute(cv::InputArray frame) override;
+
+        void GetContour(cv::OutputArray output) override;
+
+        void GetLabels(cv::OutputArray output) override;
+
+        unsigned int GetNumSuperpixels() override;
+
+        int spixel_size, no_iters;
+        float coh_weight;
+        bool do_enforce_connectivity;
+
+    protected:
+        struct Center {
+            float x, y;
+            cv::Vec3f color;
+            int no_pixels;
+        };
+
+        cv::Mat frame_lab, labels, labels_tmp;
+        int map_width = 0, map_height = 0;
+        std::vector<Center> centers;
+
+        void find_center_association();
+
+        void update_cluster_center();
+
+        static void supress_local_label(const cv::Mat &in_labels, cv::Mat &out_labels);
     };
 
 #ifdef HAS_LIBGSLIC
@@ -57,6 +193,9 @@ namespace spt {
 
         unsigned int GetNumSuperpixels() override;
 
+        /// Read per-superpixel mean color and area off the engine's cluster centers (no pass over pixels)
+        void GetRegionInfo(std::vector<RegionInfo> &output);
+
     protected:
         unsigned int width, height;
         unsigned int actual_num_superpixels = 0;
@@ -93,6 +232,39 @@ namespace spt {
     };
 
 #endif
+
+    /// Backend-agnostic superpixel parameters; each backend maps them onto its own settings
+    struct SuperpixelConfig {
+        cv::Size size;
+        int superpixel_size = 32;
+        int num_iter = 5;
+    };
+
+#ifdef HAS_LIBGSLIC
+    /// gSLICr settings the "gslic" backend uses for a config; tools driving GSLIC directly share them
+    gSLICr::objects::settings GSLICSettings(const SuperpixelConfig &config);
+#endif
+
+    /// Runtime registry of superpixel backends (name -> factory), so tools can switch backends without recompiling
+    class SuperpixelRegistry {
+    public:
+        typedef std::function<std::unique_ptr<ISuperpixel>(const SuperpixelConfig &)> Factory;
+
+        /// The registry, pre-populated with the built-in backends
+        static SuperpixelRegistry &Instance();
+
+        void Register(const std::string &name, Factory factory);
+
+        /// Returns nullptr for unknown backends
+        std::unique_ptr<ISuperpixel> Create(const std::string &name, const SuperpixelConfig &config) const;
+
+        bool Has(const std::string &name) const;
+
+        std::vector<std::string> Names() const;
+
+    protected:
+        std::map<std::string, Factory> factories;
+    };
 }
 
 #endif
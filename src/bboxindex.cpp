@@ -0,0 +1,116 @@
+#include <cmath>
+#include <algorithm>
+#include "bboxindex.hpp"
+
+namespace spt {
+    namespace {
+        /// Cell of a coordinate, kept in int range for queries far outside the grid
+        int clamp_cell(double c) {
+            return (int) std::min(std::max(std::floor(c), -1.0), 1e9);
+        }
+    }
+
+    BBoxIndex *BBoxIndex::Compute(std::vector<LabelledBBox> _bboxes, double cell_size) {
+        bboxes = std::move(_bboxes);
+        std::stable_sort(bboxes.begin(), bboxes.end(), [](const LabelledBBox &a, const LabelledBBox &b) {
+            return a.area < b.area;
+        });
+        offsets.assign(1, 0);
+        entries.clear();
+        cols = rows = 0;
+        if (bboxes.empty()) return this;
+
+        double x1 = bboxes[0].xmax, y1 = bboxes[0].ymax;
+        x0 = bboxes[0].xmin;
+        y0 = bboxes[0].ymin;
+        for (auto const &b: bboxes) {
+            x0 = std::min(x0, b.xmin);
+            y0 = std::min(y0, b.ymin);
+            x1 = std::max(x1, b.xmax);
+            y1 = std::max(y1, b.ymax);
+        }
+        cell = cell_size > 0 ? cell_size : std::sqrt((x1 - x0) * (y1 - y0) / (double) bboxes.size());
+        cell = std::max(cell, 1.0);
+        cols = cell_x(x1) + 1;
+        rows = cell_y(y1) + 1;
+
+        // Pass 1: boxes per cell, shifted by one so the prefix sum lands in place
+        offsets.assign((size_t) cols * rows + 1, 0);
+        for (auto const &b: bboxes)
+            for (int cy = cell_y(b.ymin); cy <= cell_y(b.ymax); ++cy)
+                for (int cx = cell_x(b.xmin); cx <= cell_x(b.xmax); ++cx)
+                    ++offsets[(size_t) cy * cols + cx + 1];
+        for (size_t i = 1; i < offsets.size(); ++i)
+            offsets[i] += offsets[i - 1];
+
+        // Pass 2: scatter box ids in area order
+        entries.resize(offsets.back());
+        std::vector<int> cursor(offsets.begin(), offsets.end() - 1);
+        for (int i = 0; i < (int) bboxes.size(); ++i) {
+            const LabelledBBox &b = bboxes[i];
+            for (int cy = cell_y(b.ymin); cy <= cell_y(b.ymax); ++cy)
+                for (int cx = cell_x(b.xmin); cx <= cell_x(b.xmax); ++cx)
+                    entries[cursor[(size_t) cy * cols + cx]++] = i;
+        }
+        return this;
+    }
+
+    size_t BBoxIndex::size() const {
+        return bboxes.size();
+    }
+
+    const LabelledBBox &BBoxIndex::GetBBox(int i) const {
+        return bboxes[i];
+    }
+
+    int BBoxIndex::cell_x(double x) const {
+        return clamp_cell((x - x0) / cell);
+    }
+
+    int BBoxIndex::cell_y(double y) const {
+        return clamp_cell((y - y0) / cell);
+    }
+
+    void BBoxIndex::Match(double x, double y, std::vector<int> &matches) const {
+        matches.clear();
+        const int cx = cell_x(x), cy = cell_y(y);
+        if (cx < 0 || cy < 0 || cx >= cols || cy >= rows) return;
+        const size_t c = (size_t) cy * cols + cx;
+        for (int k = offsets[c]; k < offsets[c + 1]; ++k) {
+            const LabelledBBox &b = bboxes[entries[k]];
+            if (b.xmin <= x && x <= b.xmax && b.ymin <= y && y <= b.ymax)
+                matches.push_back(entries[k]);
+        }
+    }
+
+    int BBoxIndex::Count(double x, double y) const {
+        const int cx = cell_x(x), cy = cell_y(y);
+        if (cx < 0 || cy < 0 || cx >= cols || cy >= rows) return 0;
+        const size_t c = (size_t) cy * cols + cx;
+        int ct = 0;
+        for (int k = offsets[c]; k < offsets[c + 1]; ++k) {
+            const LabelledBBox &b = bboxes[entries[k]];
+            ct += b.xmin <= x && x <= b.xmax && b.ymin <= y && y <= b.ymax;
+        }
+        return ct;
+    }
+
+    void BBoxIndex::Intersect(double xmin, double ymin, double xmax, double ymax, std::vector<int> &matches) const {
+        matches.clear();
+        if (cols == 0) return;
+        const int cx0 = std::max(cell_x(xmin), 0), cy0 = std::max(cell_y(ymin), 0),
+                cx1 = std::min(cell_x(xmax), cols - 1), cy1 = std::min(cell_y(ymax), rows - 1);
+        for (int cy = cy0; cy <= cy1; ++cy)
+            for (int cx = cx0; cx <= cx1; ++cx) {
+                const size_t c = (size_t) cy * cols + cx;
+                for (int k = offsets[c]; k < offsets[c + 1]; ++k) {
+                    const LabelledBBox &b = bboxes[entries[k]];
+                    if (b.xmin <= xmax && xmin <= b.xmax && b.ymin <= ymax && ymin <= b.ymax)
+                        matches.push_back(entries[k]);
+                }
+            }
+        // boxes spanning several cells are listed once per cell
+        std::sort(matches.begin(), matches.end());
+        matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+    }
+}
@@ -1,10 +1,329 @@
+#include <iostream>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 #include "dcnn.hpp"
+#include "misc_ocv.hpp"
+#include "build_vars.hpp"
+
+namespace spt::dnn {
+    bool ParsePrecision(const std::string &name, Precision &precision) {
+        if (name == "fp32") precision = Precision::FP32;
+        else if (name == "fp16") precision = Precision::FP16;
+        else if (name == "int8") precision = Precision::INT8;
+        else return false;
+        return true;
+    }
+
+    const char *PrecisionName(Precision precision) {
+        switch (precision) {
+            case Precision::FP16:
+                return "fp16";
+            case Precision::INT8:
+                return "int8";
+            default:
+                return "fp32";
+        }
+    }
+
+    std::string ModelVariant(const std::string &path, Precision precision) {
+        if (precision == Precision::FP32) return path;
+        const size_t slash = path.find_last_of('/'), dot = path.find_last_of('.');
+        const size_t ext = dot == std::string::npos || (slash != std::string::npos && dot < slash) ? path.size() : dot;
+        return path.substr(0, ext) + "." + PrecisionName(precision) + path.substr(ext);
+    }
+
+    void FeatureDrift::Print(std::ostream &os) const {
+        os << "Feature drift over " << rows << " superpixels: max abs " << max_abs << " (" << max_relative * 100
+           << "% of the largest feature), mean abs " << mean_abs << ", cosine min " << min_cosine << " mean "
+           << mean_cosine << std::endl;
+    }
+
+    FeatureDrift ComputeFeatureDrift(const float *reference, const float *features, size_t rows, int dim) {
+        FeatureDrift drift;
+        drift.rows = rows;
+        if (rows == 0 || dim <= 0) return drift;
+        double sum_abs = 0, sum_cosine = 0, max_reference = 0;
+        for (size_t r = 0; r < rows; ++r) {
+            const float *a = reference + r * dim, *b = features + r * dim;
+            double dot = 0, norm_a = 0, norm_b = 0;
+            for (int d = 0; d < dim; ++d) {
+                const double diff = std::fabs((double) a[d] - b[d]);
+                drift.max_abs = std::max(drift.max_abs, diff);
+                max_reference = std::max(max_reference, (double) std::fabs(a[d]));
+                sum_abs += diff;
+                dot += (double) a[d] * b[d];
+                norm_a += (double) a[d] * a[d];
+                norm_b += (double) b[d] * b[d];
+            }
+            // all-zero rows (e.g. after a ReLU) only match each other
+            const double cosine = norm_a > 0 && norm_b > 0 ? dot / std::sqrt(norm_a * norm_b) :
+                                  norm_a == norm_b ? 1.0 : 0.0;
+            drift.min_cosine = std::min(drift.min_cosine, cosine);
+            sum_cosine += cosine;
+        }
+        drift.mean_abs = sum_abs / ((double) rows * dim);
+        drift.mean_cosine = sum_cosine / rows;
+        drift.max_relative = max_reference > 0 ? drift.max_abs / max_reference : 0;
+        return drift;
+    }
+
+    TiledFeatureMap::TiledFeatureMap(IComputeFeatureMap *trunk, int tile_size, int halo, std::mutex *trunk_mutex) :
+            trunk(trunk), tile_size(tile_size), halo(halo), trunk_mutex(trunk_mutex) {
+        CV_Assert(trunk && tile_size > 0 && halo >= 0);
+    }
+
+    bool TiledFeatureMap::Compute(cv::InputArray _frame) {
+        cv::Mat frame = _frame.getMat();
+        CV_Assert(frame.type() == CV_8UC3 && !frame.empty());
+        const int stride = GetStride();
+        const int tile = (tile_size + stride - 1) / stride * stride, pad = (halo + stride - 1) / stride * stride;
+        const int map_width = (frame.cols + stride - 1) / stride, map_height = (frame.rows + stride - 1) / stride;
+        const cv::Rect frame_rect(0, 0, frame.cols, frame.rows);
+
+        for (int ty = 0; ty < frame.rows; ty += tile) {
+            for (int tx = 0; tx < frame.cols; tx += tile) {
+                // tile origins and halos are stride-aligned, so tile cells line up with frame cells
+                const cv::Rect core = cv::Rect(tx, ty, tile, tile) & frame_rect;
+                const cv::Rect input = cv::Rect(tx - pad, ty - pad, tile + 2 * pad, tile + 2 * pad) & frame_rect;
+                cv::Mat image = frame(input);
+                const int right = (input.width + stride - 1) / stride * stride - input.width;
+                const int bottom = (input.height + stride - 1) / stride * stride - input.height;
+                if (right > 0 || bottom > 0) {
+                    cv::copyMakeBorder(image, padded, 0, bottom, 0, right, cv::BORDER_REPLICATE);
+                    image = padded;
+                }
+
+                FeatureMap tile_features;
+                {
+                    std::unique_lock<std::mutex> lock;
+                    if (trunk_mutex) lock = std::unique_lock<std::mutex>(*trunk_mutex);
+                    if (!trunk->ComputeFeatureMap(image, tile_features)) return false;
+                    CV_Assert(tile_features.width * stride == image.cols && tile_features.height * stride == image.rows);
+                    if (tx == 0 && ty == 0) {
+                        channels = tile_features.channels;
+                        features.create(map_height, map_width * channels, CV_32F);
+                    }
+                    CV_Assert(tile_features.channels == channels);
+
+                    const int x0 = (core.x - input.x) / stride, y0 = (core.y - input.y) / stride;
+                    const int cols = (core.width + stride - 1) / stride, rows = (core.height + stride - 1) / stride;
+                    for (int y = 0; y < rows; ++y)
+                        std::memcpy(features.ptr<float>(core.y / stride + y) + (size_t) core.x / stride * channels,
+                                    tile_features.at(y0 + y, x0), (size_t) cols * channels * sizeof(float));
+                }
+            }
+        }
+        return true;
+    }
+
+    FeatureMap TiledFeatureMap::GetFeatureMap() const {
+        FeatureMap output;
+        output.data = features.ptr<float>();
+        output.height = features.rows;
+        output.width = channels > 0 ? features.cols / channels : 0;
+        output.channels = channels;
+        return output;
+    }
+
+    int TiledFeatureMap::GetStride() const {
+        return trunk->GetFeatureStride();
+    }
+
+    OpenCVVGG16SP::OpenCVVGG16SP(const std::string &model_path, const std::string &output_layer, int pooling_modes,
+                                 unsigned int nsp, Precision precision) :
+            pooling(pooling_modes), nsp(nsp) {
+        if (!output_layer.empty()) output_layers = {output_layer};
+        std::string path = model_path.empty() ? MODEL_WEIGHTS "vgg16.onnx" : model_path;
+        // cv::dnn runs quantized (QDQ) ONNX models with int8 layers; fp16 is a target for the fp32 weights
+        if (precision == Precision::INT8) path = ModelVariant(path, precision);
+        try {
+            net = cv::dnn::readNet(path);
+            net.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 9)
+            net.setPreferableTarget(precision == Precision::FP16 ? cv::dnn::DNN_TARGET_CPU_FP16 :
+                                    cv::dnn::DNN_TARGET_CPU);
+#else
+            if (precision == Precision::FP16)
+                std::cerr << "WARNING This OpenCV has no fp16 CPU target, running fp32" << std::endl;
+            net.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+#endif
+            std::cerr << "Network loaded " << path << " (" << PrecisionName(precision) << ")" << std::endl;
+        } catch (const cv::Exception &e) {
+            std::cerr << "WARNING Cannot load network " << path << std::endl;
+            std::cerr << e.what() << std::endl;
+        }
+    }
+
+    bool OpenCVVGG16SP::Loaded() const {
+        return !net.empty();
+    }
+
+    void OpenCVVGG16SP::SetInputResolution(unsigned int width, unsigned int height, unsigned int batch_size) {
+        this->width = width;
+        this->height = height;
+        this->batch_size = std::max(batch_size, 1u);
+    }
+
+    void OpenCVVGG16SP::SetOutputLayers(const std::vector<std::string> &layers) {
+        output_layers = layers;
+        channels.assign(std::max<size_t>(layers.size(), 1), 512);
+    }
+
+    IComputeFrameSuperpixel* OpenCVVGG16SP::Compute(cv::InputArray frame, cv::InputArray superpixels) {
+        return ComputeBatch({frame.getMat()}, {superpixels.getMat()});
+    }
+
+    IComputeFrameSuperpixel* OpenCVVGG16SP::ComputeBatch(const std::vector<cv::Mat> &frames,
+                                                         const std::vector<cv::Mat> &superpixels) {
+        if (net.empty()) return nullptr;
+        CV_Assert(!frames.empty() && frames.size() <= batch_size && superpixels.size() % frames.size() == 0);
+        const int n = static_cast<int>(frames.size()), k = static_cast<int>(superpixels.size()) / n;
+
+        {
+            Profiler::Scope scope(profiler.get(), "input");
+            cv::dnn::blobFromImages(frames, blob, scale, cv::Size(width, height), mean, swap_rb, false, CV_32F);
+            net.setInput(blob);
+        }
+        const int64_t forward_start = profiler ? Profiler::NowMicros() : 0;
+        try {
+            Profiler::Scope scope(profiler.get(), "run");
+            // all layers come out of one forward pass
+            if (output_layers.empty()) outputs = {net.forward()};
+            else net.forward(outputs, output_layers);
+        } catch (const cv::Exception &e) {
+            std::cout << e.what() << "\n";
+            return nullptr;
+        }
+        if (profiler) {
+            // cv::dnn only keeps per-layer durations, so the layers are laid end to end on the trace
+            net.getPerfProfile(layer_ticks);
+            const std::vector<std::string> names = net.getLayerNames();
+            const double micros_per_tick = 1e6 / cv::getTickFrequency();
+            int64_t start = forward_start;
+            for (size_t i = 0; i < layer_ticks.size() && i < names.size(); ++i) {
+                const int64_t micros = static_cast<int64_t>(layer_ticks[i] * micros_per_tick);
+                profiler->AddNode(names[i], net.getLayer(names[i])->type, "cv::dnn", 0, start, micros);
+                start += micros;
+            }
+        }
+        Profiler::Scope pooling_scope(profiler.get(), "pooling");
+
+        // NCHW outputs; pooling wants each frame channels-last
+        channels.resize(outputs.size());
+        for (size_t j = 0; j < outputs.size(); ++j) {
+            CV_Assert(outputs[j].dims == 4 && outputs[j].size[0] == n && outputs[j].type() == CV_32F);
+            channels[j] = outputs[j].size[1];
+        }
+        const int dim = GetFeatureDim();
+        const size_t block = (size_t) nsp * dim;
+        pooled_features.resize(superpixels.size() * block);
+        for (int i = 0; i < n; ++i) {
+            int offset = 0;
+            for (size_t j = 0; j < outputs.size(); ++j) {
+                const int fh = outputs[j].size[2], fw = outputs[j].size[3];
+                const cv::Mat planes(channels[j], fh * fw, CV_32F, outputs[j].ptr<float>(i));
+                cv::transpose(planes, feature_map);
+                FeatureMap features;
+                features.data = feature_map.ptr<float>();
+                features.height = fh;
+                features.width = fw;
+                features.channels = channels[j];
+                // one transposed map serves all of the frame's label maps
+                for (int l = i * k; l < i * k + k; ++l)
+                    pooling.Compute(features, superpixels[l], nsp, pooled_features.data() + l * block + offset, dim);
+                offset += pooling.GetFeatureDim(channels[j]);
+            }
+        }
+        return this;
+    }
+
+    int OpenCVVGG16SP::GetFeatureDim() const {
+        int dim = 0;
+        for (const int c: channels) dim += pooling.GetFeatureDim(c);
+        return dim;
+    }
+
+    int OpenCVVGG16SP::GetNSP() const {
+        return nsp;
+    }
+
+    int OpenCVVGG16SP::GetBatchSize() const {
+        return batch_size;
+    }
+
+    bool OpenCVVGG16SP::SharesTrunk() const {
+        return true;
+    }
+
+    void OpenCVVGG16SP::GetFeature(float *output_array) const {
+        GetBatchFeature(0, output_array);
+    }
+
+    void OpenCVVGG16SP::GetFeature(int superpixel_id, float *output_array) const {
+        GetBatchFeatures(0, {superpixel_id}, output_array);
+    }
+
+    void OpenCVVGG16SP::GetBatchFeature(int batch_id, float *output_array) const {
+        const size_t block = (size_t) GetFeatureDim() * GetNSP();
+        std::memcpy(output_array, pooled_features.data() + batch_id * block, block * sizeof(float));
+    }
+
+    void OpenCVVGG16SP::GetBatchFeatures(int batch_id, const std::vector<int> &ids, float *output_array) const {
+        const int dim = GetFeatureDim();
+        const float *input_array = pooled_features.data() + (size_t) batch_id * nsp * dim;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            CV_Assert(ids[i] >= 0 && ids[i] < (int) nsp);
+            std::memcpy(output_array + i * dim, input_array + (size_t) ids[i] * dim, dim * sizeof(float));
+        }
+    }
+
+    bool OpenCVVGG16SP::ComputeFeatureMap(cv::InputArray frame, FeatureMap &features) {
+        if (net.empty()) return false;
+        cv::dnn::blobFromImage(frame, tile_blob, scale, cv::Size(), mean, swap_rb, false, CV_32F);
+        net.setInput(tile_blob);
+        try {
+            tile_output = net.forward(output_layers.empty() ? std::string() : output_layers[0]);
+        } catch (const cv::Exception &e) {
+            std::cout << e.what() << "\n";
+            return false;
+        }
+        CV_Assert(tile_output.dims == 4 && tile_output.size[0] == 1 && tile_output.type() == CV_32F);
+        features.channels = tile_output.size[1];
+        features.height = tile_output.size[2];
+        features.width = tile_output.size[3];
+        const cv::Mat planes(features.channels, features.height * features.width, CV_32F, tile_output.ptr<float>());
+        cv::transpose(planes, tile_feature_map);
+        features.data = tile_feature_map.ptr<float>();
+        return true;
+    }
+
+    int OpenCVVGG16SP::GetFeatureStride() const {
+        return feature_stride;
+    }
+
+    void OpenCVVGG16SP::SetProfiler(std::shared_ptr<Profiler> profiler) {
+        this->profiler = std::move(profiler);
+    }
+}
+
 #ifdef HAS_TF
+#include <tensorflow/core/framework/step_stats.pb.h>
 
 namespace spt::dnn {
     namespace tf = tensorflow;
 
-#include "build_vars.hpp"
+    namespace {
+        /// fp16 graphs may fetch DT_HALF feature maps; pooling and the feature copies read floats
+        void half_to_float(std::vector<tf::Tensor> &tensors) {
+            for (tf::Tensor &tensor: tensors) {
+                if (tensor.dtype() != tf::DT_HALF) continue;
+                tf::Tensor converted(tf::DT_FLOAT, tensor.shape());
+                converted.flat<float>() = tensor.flat<Eigen::half>().cast<float>();
+                tensor = std::move(converted);
+            }
+        }
+    }
 
     TensorFlowInference::TensorFlowInference(std::string const &graph_path) {
         tf::Status status = tf::ReadBinaryProto(tf::Env::Default(), graph_path, &graph);
@@ -15,8 +334,16 @@ namespace spt::dnn {
         }
     }
 
+    TensorFlowInference::TensorFlowInference(tf::Session *session) :
+            session(session), _loaded(session != nullptr), _owns_session(false) {
+    }
+
     TensorFlowInference::~TensorFlowInference() {
         if (session) {
+            for (const CallableHandle handle: callables)
+                session->ReleaseCallable(handle);
+        }
+        if (session && _owns_session) {
             tf::Status status = session->Close();
             if (!status.ok()) {
                 std::cerr << "Failed to close a tf::Session." << std::endl;
@@ -24,6 +351,59 @@ namespace spt::dnn {
         }
     }
 
+    bool TensorFlowInference::MakeCallable(const std::vector<std::string> &feeds,
+                                           const std::vector<std::string> &fetches, CallableHandle &handle) {
+        ReleaseCallable(handle);
+        if (!session) return false;
+        tf::CallableOptions options;
+        for (auto const &feed: feeds) options.add_feed(feed);
+        for (auto const &fetch: fetches) options.add_fetch(fetch);
+        if (profiler) options.mutable_run_options()->set_trace_level(tf::RunOptions::FULL_TRACE);
+        tf::Status status = session->MakeCallable(options, &handle);
+        if (!status.ok()) {
+            std::cerr << "tf::Session::MakeCallable() error:" << std::endl;
+            std::cerr << status.ToString() << std::endl;
+            handle = NoCallable;
+            return false;
+        }
+        callables.push_back(handle);
+        return true;
+    }
+
+    void TensorFlowInference::ReleaseCallable(CallableHandle &handle) {
+        if (handle == NoCallable) return;
+        if (session) session->ReleaseCallable(handle);
+        callables.erase(std::remove(callables.begin(), callables.end(), handle), callables.end());
+        handle = NoCallable;
+    }
+
+    tf::Status TensorFlowInference::RunCallable(CallableHandle handle, const std::vector<tf::Tensor> &feeds,
+                                                std::vector<tf::Tensor> *fetches) {
+        if (!profiler) return session->RunCallable(handle, feeds, fetches, nullptr);
+        tf::RunMetadata metadata;
+        tf::Status status;
+        {
+            Profiler::Scope scope(profiler.get(), "run");
+            status = session->RunCallable(handle, feeds, fetches, &metadata);
+        }
+        for (const tf::DeviceStepStats &device: metadata.step_stats().dev_stats()) {
+            for (const tf::NodeExecStats &node: device.node_stats()) {
+                // the op type only shows in the timeline label, "name = Op(inputs)"
+                const std::string &label = node.timeline_label();
+                const size_t equals = label.find(" = "), paren = label.find('(', equals);
+                const std::string op = equals == std::string::npos || paren == std::string::npos ?
+                                       node.node_name() : label.substr(equals + 3, paren - equals - 3);
+                profiler->AddNode(node.node_name(), op, device.device(), node.thread_id(), node.all_start_micros(),
+                                  node.all_end_rel_micros());
+            }
+        }
+        return status;
+    }
+
+    void TensorFlowInference::SetProfiler(std::shared_ptr<Profiler> profiler) {
+        this->profiler = std::move(profiler);
+    }
+
     void TensorFlowInference::Summary() {
         if (!_loaded) return;
         std::cout << "Model Summary" << std::endl;
@@ -52,6 +432,7 @@ namespace spt::dnn {
             }
         }
         std::cout << "EOF Model Summary" << std::endl;
+        if (profiler) profiler->Print(std::cout);
     }
 
     bool TensorFlowInference::NewSession() {
@@ -76,6 +457,46 @@ namespace spt::dnn {
     }
 
 
+    SessionPool::SessionPool(const tf::GraphDef &graph, const Options &options) {
+        tf::SessionOptions config;
+        if (options.intra_op_threads > 0)
+            config.config.set_intra_op_parallelism_threads(options.intra_op_threads);
+        if (options.inter_op_threads > 0)
+            config.config.set_inter_op_parallelism_threads(options.inter_op_threads);
+        if (options.gpu_memory_fraction > 0)
+            config.config.mutable_gpu_options()->set_per_process_gpu_memory_fraction(options.gpu_memory_fraction);
+        for (int i = 0; i < options.num_sessions; ++i) {
+            tf::Session *session = nullptr;
+            tf::Status status = tf::NewSession(config, &session);
+            if (status.ok()) status = session->Create(graph);
+            if (!status.ok()) {
+                std::cerr<<"SessionPool: session "<<i<<" error:"<<std::endl;
+                std::cerr<<status.ToString()<<std::endl;
+                delete session;
+                continue;
+            }
+            sessions.push_back(session);
+        }
+    }
+
+    SessionPool::~SessionPool() {
+        for (tf::Session *session: sessions) {
+            tf::Status status = session->Close();
+            if (!status.ok()) {
+                std::cerr << "Failed to close a tf::Session." << std::endl;
+            }
+            delete session;
+        }
+    }
+
+    size_t SessionPool::size() const {
+        return sessions.size();
+    }
+
+    tf::Session *SessionPool::operator[](size_t i) const {
+        return sessions[i];
+    }
+
     VGG16::VGG16() :
             TensorFlowInference(MODEL_WEIGHTS "vgg16.frozen.pb") {
         // TODO fix this
@@ -88,21 +509,31 @@ namespace spt::dnn {
         this->inputs = {
                 {"DataSource/Placeholder:0", input_tensor},
         };
+        if (session) MakeCallable({inputs[0].first}, output_nodes, callable);
+    }
+
+    void VGG16::SetOutputNodes(const std::vector<std::string> &nodes) {
+        CV_Assert(!nodes.empty());
+        output_nodes = nodes;
+        if (session) MakeCallable({inputs[0].first}, output_nodes, callable);
+    }
+
+    const std::vector<tf::Tensor> &VGG16::GetOutputs() const {
+        return outputs;
     }
 
     void VGG16::Compute(cv::InputArray frame) {
         if (!session) return;
 
-        cv::Mat image;
-        // image.convertTo(image, CV_32FC3);
-        cv::resize(frame, image, cv::Size(256, 256));
+        // resize straight into the tensor's buffer
+        CV_Assert(frame.type() == CV_8UC3);
+        cv::Mat image((int) input_shape.dim_size(1), (int) input_shape.dim_size(2), CV_8UC3,
+                      input_tensor.flat<tf::uint8>().data());
+        cv::resize(frame, image, image.size());
 
-        // * DOUBLE CHECK: SIZE TYPE CONTINUITY
-        CV_Assert(image.type() == CV_8UC3);
-        tf::StringPiece input_buffer = input_tensor.tensor_data();
-        std::memcpy(const_cast<char *>(input_buffer.data()), image.data, input_shape.num_elements() * sizeof(char));
-
-        tf::Status status = session->Run(inputs, {"DCNN/block5_pool/MaxPool:0"}, {}, &outputs);
+        // the session may have been created after SetInputResolution()
+        if (callable == NoCallable && !MakeCallable({inputs[0].first}, output_nodes, callable)) return;
+        tf::Status status = RunCallable(callable, {input_tensor}, &outputs);
         if (!status.ok()) {
             std::cout << status.ToString() << "\n";
             return;
@@ -120,79 +551,218 @@ namespace spt::dnn {
             TensorFlowInference(MODEL_WEIGHTS "vgg16sp.frozen.pb") {
     }
 
-    void VGG16SP::SetInputResolution(unsigned int width, unsigned int height) {
+    VGG16SP::VGG16SP(const std::string &graph_path) :
+            TensorFlowInference(graph_path) {
+    }
+
+    VGG16SP::VGG16SP(tf::Session *session) :
+            TensorFlowInference(session) {
+    }
+
+    void VGG16SP::SetInputResolution(unsigned int width, unsigned int height, unsigned int batch_size) {
         std::cerr<<"SetInputResolution(): adding input tensors"<<std::endl;
-        this->input_shape = tf::TensorShape({1, height, width, 3});
+        this->width = width;
+        this->height = height;
+        this->batch_size = std::max(batch_size, 1u);
+        this->input_shape = tf::TensorShape({this->batch_size, height, width, 3});
         this->input_tensor = tf::Tensor(tf::DT_UINT8, input_shape);
-        this->superpixel_shape = tf::TensorShape({1, height, width});
+        this->superpixel_shape = tf::TensorShape({this->batch_size, height, width});
         this->superpixel_tensor = tf::Tensor(tf::DT_INT32, superpixel_shape);
         this->inputs = {
                 {"DataSource/input_image:0",       input_tensor},
                 {"DataSource/input_superpixels:0", superpixel_tensor},
         };
+        make_callables();
+    }
+
+    void VGG16SP::make_callables() {
+        if (!session) return;
+        // C++ pooling fetches feature maps, which only depend on the image
+        if (pooling) {
+            MakeCallable({"DataSource/input_image:0"}, output_nodes, callable);
+            MakeCallable({"DataSource/input_image:0"}, {output_nodes[0]}, tile_callable);
+        } else {
+            MakeCallable({"DataSource/input_image:0", "DataSource/input_superpixels:0"}, output_nodes, callable);
+            ReleaseCallable(tile_callable);
+        }
+    }
+
+    void VGG16SP::SetPooling(const std::string &feature_node, int modes, unsigned int nsp, int stride) {
+        SetPooling(feature_node.empty() ? std::vector<std::string>() : std::vector<std::string>{feature_node},
+                   modes, nsp, stride);
+    }
+
+    void VGG16SP::SetPooling(const std::vector<std::string> &feature_nodes, int modes, unsigned int nsp, int stride) {
+        if (feature_nodes.empty()) {
+            output_nodes = {"Superpixels/MatMul:0"};
+            pooling.reset();
+        } else {
+            output_nodes = feature_nodes;
+            pooling = std::make_unique<SuperpixelPooling>(modes);
+            pooling_nsp = nsp;
+            pooling_stride = stride;
+        }
+        make_callables();
     }
 
     IComputeFrameSuperpixel* VGG16SP::Compute(cv::InputArray frame, cv::InputArray superpixels) {
+        return ComputeBatch({frame.getMat()}, {superpixels.getMat()});
+    }
+
+    IComputeFrameSuperpixel* VGG16SP::ComputeBatch(const std::vector<cv::Mat> &frames,
+                                                   const std::vector<cv::Mat> &superpixels) {
         if (!session) return nullptr;
+        CV_Assert(!frames.empty() && frames.size() <= batch_size && superpixels.size() % frames.size() == 0);
+        const int n = static_cast<int>(frames.size()), k = static_cast<int>(superpixels.size()) / n;
+        CV_Assert(k == 1 || pooling);
+        const size_t image_elements = (size_t) height * width * 3, superpixel_elements = (size_t) height * width;
+
+        // Mat headers over the tensors' own buffers: resize/copy write the batch slot in place, no staging copy
+        tf::uint8 *_input_buffer = input_tensor.flat<tf::uint8>().data();
+        tf::int32 *_superpixel_buffer = superpixel_tensor.flat<tf::int32>().data();
+        {
+            Profiler::Scope scope(profiler.get(), "input");
+            for (int i = 0; i < n; ++i) {
+                CV_Assert(frames[i].type() == CV_8UC3);
+                cv::Mat image(height, width, CV_8UC3, _input_buffer + i * image_elements);
+                if (frames[i].size() == image.size()) frames[i].copyTo(image);
+                else cv::resize(frames[i], image, image.size());
 
-        cv::Mat image, _superpixels;
-        // image.convertTo(image, CV_32FC3);
-        cv::resize(frame, image, cv::Size(256, 256));
-        // std::cout<<"resize1"<<std::endl;
-        // TODO it is difficult to efficiently resize an int array, fixing at 256x256 for now
-        // CV_Assert(superpixels.type() == CV_32SC1);
-        // std::cout<<"superpixel input size "<< superpixels.cols() <<" "<< superpixels.rows() <<std::endl;
-        // cv::resize(superpixels, _superpixels, cv::Size(256, 256), 0, 0, cv::INTER_LINEAR);
-        // std::cout<<"resize2"<<std::endl;
-        _superpixels = superpixels.getMat();
-
-        // * DOUBLE CHECK: SIZE TYPE CONTINUITY
-        CV_Assert(image.type() == CV_8UC3);
-        auto input_buffer = this->input_tensor.tensor<tf::uint8, 4>();
-        auto superpixel_buffer = this->superpixel_tensor.tensor<tf::int32, 3>();
-        tf::uint8 *_input_buffer = input_buffer.data();
-        tf::int32 *_superpixel_buffer = superpixel_buffer.data();
-
-//        std::cout<<input_tensor.DeviceSafeDebugString()<<std::endl;
-//        std::cout<<"VGG16SP::Compute(): copy "<<input_shape.num_elements() * sizeof(char)<<" Bytes from "<< (void*)image.data <<" to "<< (void*)_input_buffer <<std::endl;
-//        std::cout<<superpixel_tensor.DeviceSafeDebugString()<<std::endl;
-//        std::cout<<"VGG16SP::Compute(): copy "<<superpixel_shape.num_elements() * sizeof(int)<<" Bytes from "<< (void*)_superpixels.data <<" to "<< (void*)_superpixel_buffer <<std::endl;
-//        std::cout<<"Tensor is initialized? "<<input_tensor.IsInitialized()<<std::endl;
-        std::memcpy(_input_buffer, image.data, input_shape.num_elements() * sizeof(char));
-
-        CV_Assert(_superpixels.type() == CV_32SC1);
-        std::memcpy(_superpixel_buffer, _superpixels.data,
-                    superpixel_shape.num_elements() * sizeof(int));
-
-        tf::Status status = session->Run(inputs, {"Superpixels/MatMul:0"}, {}, &outputs);
+                // pooled in C++ from the labels as given, so the label tensor is not needed
+                if (pooling) continue;
+                // labels can come at the chip resolution; nearest-neighbor keeps them valid ids
+                cv::Mat labels(height, width, CV_32SC1, _superpixel_buffer + i * superpixel_elements);
+                cv_misc::ResizeNearestLabels(superpixels[i], labels, labels.size());
+            }
+        }
+
+        // Partial batch: the slices alias the first n frames of the input tensors
+        if (pooling) {
+            feeds = {n == (int) batch_size ? input_tensor : input_tensor.Slice(0, n)};
+        } else if (n == (int) batch_size) {
+            feeds = {input_tensor, superpixel_tensor};
+        } else {
+            feeds = {input_tensor.Slice(0, n), superpixel_tensor.Slice(0, n)};
+        }
+        if (callable == NoCallable) make_callables();
+        if (callable == NoCallable) return nullptr;
+        tf::Status status = RunCallable(callable, feeds, &outputs);
         if (!status.ok()) {
             std::cout << status.ToString() << "\n";
             return nullptr;
         }
+        half_to_float(outputs);
+
+        if (pooling) {
+            Profiler::Scope scope(profiler.get(), "pooling");
+            // {batch, height, width, channels} feature maps, pooled side by side into {batch, NSP, feature} rows
+            const int dim = GetFeatureDim();
+            const size_t block = (size_t) pooling_nsp * dim;
+            pooled_features.resize(superpixels.size() * block);
+            int offset = 0;
+            for (const tf::Tensor &feature_map: outputs) {
+                CV_Assert(feature_map.dims() == 4 && feature_map.dtype() == tf::DT_FLOAT);
+                FeatureMap features;
+                features.height = (int) feature_map.dim_size(1);
+                features.width = (int) feature_map.dim_size(2);
+                features.channels = (int) feature_map.dim_size(3);
+                const size_t map_elements = (size_t) features.height * features.width * features.channels;
+                for (int l = 0; l < n * k; ++l) {
+                    features.data = feature_map.flat<float>().data() + (l / k) * map_elements;
+                    pooling->Compute(features, superpixels[l], pooling_nsp, pooled_features.data() + l * block + offset,
+                                     dim);
+                }
+                offset += pooling->GetFeatureDim(features.channels);
+            }
+        }
         return this;
     }
 
     int VGG16SP::GetFeatureDim() const {
-        return 512;
+        if (outputs.empty() || outputs[0].dims() < 2)
+            return pooling ? pooling->GetFeatureDim(512) * (int) output_nodes.size() : 512;
+        if (!pooling) return static_cast<int>(outputs[0].dim_size(outputs[0].dims() - 1));
+        int dim = 0;
+        for (const tf::Tensor &output: outputs)
+            dim += pooling->GetFeatureDim(static_cast<int>(output.dim_size(output.dims() - 1)));
+        return dim;
     }
 
     int VGG16SP::GetNSP() const {
-        return 300;
+        if (pooling) return pooling_nsp;
+        if (outputs.empty() || outputs[0].dims() < 2) return 300;
+        return static_cast<int>(outputs[0].dim_size(outputs[0].dims() - 2));
+    }
+
+    const float *VGG16SP::feature_data() const {
+        return pooling ? pooled_features.data() : outputs[0].flat<float>().data();
     }
 
     void VGG16SP::GetFeature(int superpixel_id, float *output_array) const {
-        // Make a copy to detach the lifetime of the output feature array from the tensor.
+        GetBatchFeatures(0, {superpixel_id}, output_array);
+    }
+
+    int VGG16SP::GetBatchSize() const {
+        return batch_size;
+    }
 
-        // std::cerr<<"tensor ptr "<<(const void*)outputs[0].flat<float>().data()<<" superpixel "<<superpixel_id<<std::endl;
-        const float *input_array = outputs[0].flat<float>().data() + superpixel_id * GetFeatureDim();
-        // std::cerr<<"memcpy "<<(const void*) input_array<<" >> "<<(void*)output_array<<std::endl;
-        std::memcpy(output_array, input_array, GetFeatureDim() * sizeof(float));
+    bool VGG16SP::SharesTrunk() const {
+        return pooling != nullptr;
     }
 
     void VGG16SP::GetFeature(float *output_array) const {
+        GetBatchFeature(0, output_array);
+    }
+
+    void VGG16SP::GetBatchFeature(int batch_id, float *output_array) const {
         // Make a copy to detach the lifetime of the output feature array from the tensor.
-        const float *input_array = outputs[0].flat<float>().data();
-        std::memcpy(output_array, input_array, GetFeatureDim() * GetNSP() * sizeof(float));
+        // The output is laid out as {batch, NSP, feature}
+        const size_t block = (size_t) GetFeatureDim() * GetNSP();
+        const float *input_array = feature_data() + batch_id * block;
+        std::memcpy(output_array, input_array, block * sizeof(float));
+    }
+
+    void VGG16SP::GetBatchFeatures(int batch_id, const std::vector<int> &ids, float *output_array) const {
+        // Make a copy to detach the lifetime of the output feature array from the tensor.
+        const int dim = GetFeatureDim(), nsp = GetNSP();
+        const float *input_array = feature_data() + (size_t) batch_id * nsp * dim;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            CV_Assert(ids[i] >= 0 && ids[i] < nsp);
+            std::memcpy(output_array + i * dim, input_array + (size_t) ids[i] * dim, dim * sizeof(float));
+        }
+    }
+
+    bool VGG16SP::ComputeFeatureMap(cv::InputArray _frame, FeatureMap &features) {
+        if (!session) return false;
+        if (!pooling) {
+            std::cerr << "ComputeFeatureMap() needs a feature node, see SetPooling()" << std::endl;
+            return false;
+        }
+        cv::Mat frame = _frame.getMat();
+        CV_Assert(frame.type() == CV_8UC3);
+        if (tile_tensor.dims() != 4 || tile_tensor.dim_size(1) != frame.rows || tile_tensor.dim_size(2) != frame.cols)
+            tile_tensor = tf::Tensor(tf::DT_UINT8, tf::TensorShape({1, frame.rows, frame.cols, 3}));
+        frame.copyTo(cv::Mat(frame.rows, frame.cols, CV_8UC3, tile_tensor.flat<tf::uint8>().data()));
+
+        if (tile_callable == NoCallable) make_callables();
+        if (tile_callable == NoCallable) return false;
+        tf::Status status = RunCallable(tile_callable, {tile_tensor}, &tile_outputs);
+        if (!status.ok()) {
+            std::cout << status.ToString() << "\n";
+            return false;
+        }
+        half_to_float(tile_outputs);
+        const tf::Tensor &feature_map = tile_outputs[0];
+        CV_Assert(feature_map.dims() == 4 && feature_map.dtype() == tf::DT_FLOAT);
+        features.data = feature_map.flat<float>().data();
+        features.height = (int) feature_map.dim_size(1);
+        features.width = (int) feature_map.dim_size(2);
+        features.channels = (int) feature_map.dim_size(3);
+        return true;
+    }
+
+    int VGG16SP::GetFeatureStride() const {
+        return pooling_stride;
     }
 }
 
@@ -1,6 +1,9 @@
 #include <string>
 #include <thread>
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <pqxx/pqxx>
@@ -9,6 +12,10 @@
 #include "misc_os.hpp"
 #include "misc_ocv.hpp"
 #include "superpixel.hpp"
+#include "hierarchy.hpp"
+#include "spindex.hpp"
+#include "bboxindex.hpp"
+#include "segcache.hpp"
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -41,46 +48,39 @@ const std::vector<std::string> images = {
         "train_images/1438.tif"  // Yacht,75
 };
 
-void process_tif(const fs::path &dataset, const std::string &fname, const fs::path &output, const float chip_overlap, const int sp_size, bool verbose = false) {
+void process_tif(const fs::path &dataset, const std::string &fname, const fs::path &output, const float chip_overlap, const std::vector<int> &sp_sizes, spt::SegmentationCache *segmentation_cache, bool verbose = false) {
     cv::Mat frame_raw = cv::imread(fname, cv::IMREAD_COLOR);
     cv::Size real_size = frame_raw.size();
-    const int width = 385, height = 385, size_class = sp_size;
+    const int width = 385, height = 385;
     cv_misc::Chipping chips(real_size, cv::Size(width, height), chip_overlap);
 
-    spt::GSLIC _superpixel({
-                                   .img_size = { width, height },
-                                   .no_segs = 64,
-                                   .spixel_size = size_class,
-                                   .no_iters = 5,
-                                   .coh_weight = 0.6f,
-                                   .do_enforce_connectivity = true,
-                                   .color_space = gSLICr::CIELAB,
-                                   .seg_method = gSLICr::GIVEN_SIZE
-                           });
+    // Segment once at the finest size; coarser size classes are cut from the merge hierarchy
+    const int size_class = *std::min_element(sp_sizes.begin(), sp_sizes.end());
+
+    // the "gslic" backend's settings, so label maps are keyed the same as superpixel_process's
+    const spt::SuperpixelConfig sp_config = {.size = {width, height}, .superpixel_size = size_class, .num_iter = 5};
+    spt::GSLIC _superpixel(spt::GSLICSettings(sp_config));
+    // --segmentation-cache: leaves and their CIELAB stats, so the hierarchy is rebuilt without gSLICr, also from
+    // superpixel_process's label-only entries
+    const uint64_t image_hash = segmentation_cache ? os_misc::HashFile(fname.c_str()) : 0;
+    const std::string segmentation_settings = spt::SegmentationSettings("gslic", sp_config);
+    spt::SegmentationResult cached;
 
     try {
         pqxx::connection conn("dbname=xview user=postgres");
         fs::path pthFname(fname);
         conn.prepare("sql_find_frame_id", "select id from frame where image = $1");
 #if 0
-        conn.prepare("sql_match_bbox2_ct", // (image, cx, cy)
-                     "select count(*) \
-from frame join bbox on frame.id = bbox.frame_id join class_label cls on bbox.xview_type_id = cls.id \
-where frame.image = $1 and st_point($2, $3) && bbox.xview_bounds_imcoords;");
-        conn.prepare("sql_bbox_in_view", // (image, cx, cy)
-                     "select image, cls.label_name, bbox.xview_type_id, ST_XMin(bbox.xview_bounds_imcoords) as xmin, ST_YMin(bbox.xview_bounds_imcoords) as ymin, ST_XMax(bbox.xview_bounds_imcoords) as xmax, ST_YMax(bbox.xview_bounds_imcoords) as ymax \
-from frame join bbox on frame.id = bbox.frame_id join class_label cls on bbox.xview_type_id = cls.id \
-where frame.image = $1 and ST_MakeEnvelope($2, $3, $4, $5) && bbox.xview_bounds_imcoords;");
+        conn.prepare("sql_frame_bboxes", // (frame_id)
+                     "select cls.label_name, bbox.xview_type_id, ST_XMin(bbox.xview_bounds_imcoords) as xmin, ST_YMin(bbox.xview_bounds_imcoords) as ymin, ST_XMax(bbox.xview_bounds_imcoords) as xmax, ST_YMax(bbox.xview_bounds_imcoords) as ymax, st_area(bbox.xview_bounds_imcoords) as area \
+from bbox join class_label cls on bbox.xview_type_id = cls.id \
+where bbox.frame_id = $1 and bbox.xview_bounds_imcoords is not null;");
 #else
         // Sub-selection
-        conn.prepare("sql_match_bbox2_ct", // (image, cx, cy)
-                     "select count(*) \
-from frame join bbox on frame.id = bbox.frame_id join class_label cls on bbox.xview_type_id = cls.id \
-where frame.image = $1 AND cls.label_name in ('Tower','Fixed-wing Aircraft', 'Yacht', 'Passenger Vehicle', 'Shipping Container') and st_point($2, $3) && bbox.xview_bounds_imcoords;");
-        conn.prepare("sql_bbox_in_view", // (image, cx, cy)
-                     "select image, cls.label_name, bbox.xview_type_id, ST_XMin(bbox.xview_bounds_imcoords) as xmin, ST_YMin(bbox.xview_bounds_imcoords) as ymin, ST_XMax(bbox.xview_bounds_imcoords) as xmax, ST_YMax(bbox.xview_bounds_imcoords) as ymax \
-from frame join bbox on frame.id = bbox.frame_id join class_label cls on bbox.xview_type_id = cls.id \
-where frame.image = $1 AND cls.label_name in ('Tower','Fixed-wing Aircraft', 'Yacht', 'Passenger Vehicle', 'Shipping Container') and ST_MakeEnvelope($2, $3, $4, $5) && bbox.xview_bounds_imcoords;");
+        conn.prepare("sql_frame_bboxes", // (frame_id)
+                     "select cls.label_name, bbox.xview_type_id, ST_XMin(bbox.xview_bounds_imcoords) as xmin, ST_YMin(bbox.xview_bounds_imcoords) as ymin, ST_XMax(bbox.xview_bounds_imcoords) as xmax, ST_YMax(bbox.xview_bounds_imcoords) as ymax, st_area(bbox.xview_bounds_imcoords) as area \
+from bbox join class_label cls on bbox.xview_type_id = cls.id \
+where bbox.frame_id = $1 AND cls.label_name in ('Tower','Fixed-wing Aircraft', 'Yacht', 'Passenger Vehicle', 'Shipping Container') and bbox.xview_bounds_imcoords is not null;");
 #endif
         pqxx::work w_frame(conn);
 #if __has_include(<filesystem>)
@@ -104,19 +104,32 @@ where frame.image = $1 AND cls.label_name in ('Tower','Fixed-wing Aircraft', 'Ya
 
         int frame_id = r[0][0].as<int>();
 
-        cv::Mat frame, frame_rgb, frame_rgb2, superpixel_labels, superpixel_selected, superpixel_contour, im_save;
+        // Every bbox of the frame in one query; chip views and superpixel centroids are matched locally
+        spt::BBoxIndex bbox_index;
+        {
+            pqxx::work w_bbox(conn);
+            r = w_bbox.exec_prepared("sql_frame_bboxes", frame_id);
+            w_bbox.commit();
+            std::vector<spt::LabelledBBox> bboxes;
+            for (auto const &row: r)
+                bboxes.push_back({row["xmin"].as<double>(), row["ymin"].as<double>(), row["xmax"].as<double>(), row["ymax"].as<double>(),
+                                  row["area"].as<double>(), row["xview_type_id"].as<int>(), row["label_name"].as<std::string>()});
+            bbox_index.Compute(std::move(bboxes));
+        }
+        std::vector<int> bbox_view;
+
+        cv::Mat frame, frame_lab, frame_rgb, frame_rgb2, superpixel_leaves, superpixel_labels, superpixel_selected, superpixel_contour, im_save;
         std::vector<std::vector<cv::Point>> superpixel_sel_contour;
-        cv::Rect roi;
+        cv::Rect roi, superpixel_roi;
         cv::Moments superpixel_moments;
+        std::vector<spt::RegionInfo> superpixel_info;
+        spt::RegionHierarchy hierarchy;
+        spt::SuperpixelIndex superpixel_index;
 
+        // Estimated from the seed grid; each chip is segmented once below, where the actual count is kept
         unsigned long ct_superpixel = 0;
-        for(int chip_id = 0; chip_id<chips.nchip; ++chip_id) {
-            roi = chips.GetROI(chip_id);
-            frame = frame_raw(roi);
-            spt::ISuperpixel *superpixel = _superpixel.Compute(frame);
-            ct_superpixel += superpixel->GetNumSuperpixels();
-        }
-        std::cout<<"Superpixels to be scanned: "<<ct_superpixel<<std::endl;
+        std::cout<<"Superpixels to be scanned: ~"<<(unsigned long) chips.nchip * (width / size_class) * (height / size_class)
+                 <<" in "<<chips.nchip<<" chips"<<std::endl;
 
         const cv::Scalar color_superpixel(200, 5, 240), color_bbox(240, 240, 5);
 
@@ -124,69 +137,90 @@ where frame.image = $1 AND cls.label_name in ('Tower','Fixed-wing Aircraft', 'Ya
             roi = chips.GetROI(chip_id);
 
             frame = frame_raw(roi);
-            cv::cvtColor(frame, frame_rgb, cv::COLOR_BGR2RGB);
-            frame_rgb2 = frame_rgb.clone();
-            spt::ISuperpixel *superpixel = _superpixel.Compute(frame_rgb);
-            unsigned int nsp = superpixel->GetNumSuperpixels();
-            superpixel->GetLabels(superpixel_labels);
-            superpixel->GetContour(superpixel_contour);
+            const std::string key = spt::SegmentationCache::Key(image_hash, roi, segmentation_settings);
+            if (segmentation_cache && segmentation_cache->Load(key, cached, &superpixel_info)) {
+                superpixel_leaves = cached.labels;
+                // superpixel_process stores labels only: take the stats off the pixels, in gSLICr's CIELAB
+                if (superpixel_info.empty()) {
+                    frame.convertTo(frame_lab, CV_32FC3, 1.0 / 255);
+                    cv::cvtColor(frame_lab, frame_lab, cv::COLOR_BGR2Lab);
+                    spt::ComputeRegionInfo(frame_lab, superpixel_leaves, cached.num_superpixels, superpixel_info);
+                }
+            } else {
+                // BGR, as GSLIC expects and superpixel_process segments, so the cached label maps agree
+                spt::ISuperpixel *superpixel = _superpixel.Compute(frame);
+                superpixel->GetLabels(superpixel_leaves);
+                _superpixel.GetRegionInfo(superpixel_info);
+                if (segmentation_cache)
+                    segmentation_cache->Store(key, superpixel_leaves, superpixel->GetNumSuperpixels(), &superpixel_info);
+            }
+            hierarchy.Compute(superpixel_leaves, superpixel_info);
+            ct_superpixel += hierarchy.GetNumSuperpixels();
 
             char cstr_fname_out[200];
 
             // Save input image
-            if (sp_size == 8) { // TODO change to tid
-                std::snprintf(cstr_fname_out, 200, "f%dc%di.png", frame_id, chip_id);
-                cv::imwrite((output / cstr_fname_out).string(), frame);
-            }
+            std::snprintf(cstr_fname_out, 200, "f%dc%di.png", frame_id, chip_id);
+            cv::imwrite((output / cstr_fname_out).string(), frame);
 
-            // Draw superpixels
-            frame_rgb.setTo(color_superpixel, superpixel_contour);
+            // Labelled bounding boxes are the same for every size class
+            bbox_index.Intersect(roi.x, roi.y, roi.x+roi.width, roi.y+roi.height, bbox_view);
 
-            // Draw labelled bounding boxes
-            pqxx::work w_bbox(conn);
-            pqxx::result r = w_bbox.exec_prepared("sql_bbox_in_view", image, roi.x, roi.y, roi.x+roi.width, roi.y+roi.height);
-            w_bbox.commit();
-            for (auto const &row: r) {
-                const int xmin = row["xmin"].as<int>()-roi.x,
-                    ymin = row["ymin"].as<int>()-roi.y,
-                    xmax = row["xmax"].as<int>()-roi.x,
-                    ymax = row["ymax"].as<int>()-roi.y;
-                const cv::Point a(xmin, ymin), b(xmax, ymax);
-                cv::rectangle(frame_rgb, a, b, color_bbox, 2);
-            }
+            for (const int sp_size: sp_sizes) {
+                // Same superpixel count as a gSLICr grid with spixel_size = sp_size
+                const unsigned int target = (unsigned int) ((width / sp_size) * (height / sp_size));
+                const unsigned int nsp = hierarchy.GetLabels(target, superpixel_labels);
+                superpixel_index.Compute(superpixel_labels, nsp);
+                spt::GetLabelContour(superpixel_labels, superpixel_contour);
+
+                cv::cvtColor(frame, frame_rgb, cv::COLOR_BGR2RGB);
+                frame_rgb2 = frame_rgb.clone();
+
+                // Draw superpixels
+                frame_rgb.setTo(color_superpixel, superpixel_contour);
+
+                // Draw labelled bounding boxes
+                for (const int i: bbox_view) {
+                    const spt::LabelledBBox &bbox = bbox_index.GetBBox(i);
+                    const int xmin = (int) std::lround(bbox.xmin)-roi.x,
+                        ymin = (int) std::lround(bbox.ymin)-roi.y,
+                        xmax = (int) std::lround(bbox.xmax)-roi.x,
+                        ymax = (int) std::lround(bbox.ymax)-roi.y;
+                    const cv::Point a(xmin, ymin), b(xmax, ymax);
+                    cv::rectangle(frame_rgb, a, b, color_bbox, 2);
+                }
 
-            cv::cvtColor(frame_rgb, im_save, cv::COLOR_RGB2BGR);
-
-            std::snprintf(cstr_fname_out, 200, "f%dc%ds%d.png", frame_id, chip_id, (int)sp_size);
-            std::string fname_out = output / std::string(cstr_fname_out);
-            cv::imwrite(fname_out, im_save);
-
-            // Draw superpixel labels
-            int total_match = 0;
-            for(unsigned int s = 0; s<nsp; ++s) {
-                superpixel_selected = superpixel_labels == s;
-                cv::findContours(superpixel_selected, superpixel_sel_contour, cv::RETR_TREE, cv::CHAIN_APPROX_SIMPLE);
-                superpixel_moments = cv::moments(superpixel_sel_contour[0], true);
-                const auto area = static_cast<float>(superpixel_moments.m00);
-                if (area > 0) {
-                    const auto cxf32 = static_cast<float>(superpixel_moments.m10/area+roi.x), cyf32 = static_cast<float>(superpixel_moments.m01/area+roi.y);
-                    pqxx::work w_bbox_match(conn);
-                    r = w_bbox_match.exec_prepared("sql_match_bbox2_ct", image, (int)cxf32, (int)cyf32);
-                    w_bbox.commit();
-                    const auto ct_match = r[0][0].as<int>();
-                    if (ct_match > 0) {
-                        cv::drawContours(frame_rgb2, superpixel_sel_contour, 0, color_bbox, 1);
-                        ++total_match;
+                cv::cvtColor(frame_rgb, im_save, cv::COLOR_RGB2BGR);
+
+                std::snprintf(cstr_fname_out, 200, "f%dc%ds%d.png", frame_id, chip_id, (int)sp_size);
+                std::string fname_out = output / std::string(cstr_fname_out);
+                cv::imwrite(fname_out, im_save);
+
+                // Draw superpixel labels
+                int total_match = 0;
+                for(unsigned int s = 0; s<nsp; ++s) {
+                    superpixel_index.GetMask(s, superpixel_selected, superpixel_roi);
+                    cv::findContours(superpixel_selected, superpixel_sel_contour, cv::RETR_TREE, cv::CHAIN_APPROX_SIMPLE, superpixel_roi.tl());
+                    superpixel_moments = cv::moments(superpixel_sel_contour[0], true);
+                    const auto area = static_cast<float>(superpixel_moments.m00);
+                    if (area > 0) {
+                        const auto cxf32 = static_cast<float>(superpixel_moments.m10/area+roi.x), cyf32 = static_cast<float>(superpixel_moments.m01/area+roi.y);
+                        const int ct_match = bbox_index.Count((int)cxf32, (int)cyf32);
+                        if (ct_match > 0) {
+                            cv::drawContours(frame_rgb2, superpixel_sel_contour, 0, color_bbox, 1);
+                            ++total_match;
+                        }
                     }
                 }
-            }
 
-            if (total_match > 0) {
-                cv::cvtColor(frame_rgb2, im_save, cv::COLOR_RGB2BGR);
-                std::snprintf(cstr_fname_out, 200, "f%dc%ds%dm.png", frame_id, chip_id, (int) sp_size);
-                cv::imwrite((output / cstr_fname_out).string(), im_save);
+                if (total_match > 0) {
+                    cv::cvtColor(frame_rgb2, im_save, cv::COLOR_RGB2BGR);
+                    std::snprintf(cstr_fname_out, 200, "f%dc%ds%dm.png", frame_id, chip_id, (int) sp_size);
+                    cv::imwrite((output / cstr_fname_out).string(), im_save);
+                }
             }
         }
+        std::cout<<fname<<": "<<ct_superpixel<<" superpixels in "<<chips.nchip<<" chips"<<std::endl;
     }
     catch (const std::exception &e) {
         std::cerr<<e.what()<<std::endl;
@@ -202,6 +236,7 @@ int main(int argc, char* argv[]) {
     parser.add_argument("-d", "Dataset location", true);
     parser.add_argument("-o", "Output location", true);
     parser.add_argument("-c", "Chipping Overlap (=0.5)");
+    parser.add_argument("--segmentation-cache", "Reuse Label Maps across Runs and Tools from this Record File (=off)");
     try {
         parser.parse(argc, argv);
     } catch (const ArgumentParser::ArgumentNotFound& ex) {
@@ -221,6 +256,10 @@ int main(int argc, char* argv[]) {
     ///////////////////////////
     const float chip_overlap = parser.exists("c") ? parser.get<float>("c") : 0.5;
 
+    spt::SegmentationCache segmentation_cache;
+    if (parser.exists("segmentation-cache") && !segmentation_cache.Open(parser.get<std::string>("segmentation-cache")))
+        return 1;
+
 //    ///////////////////////////
 //    // Superpixel
 //    ///////////////////////////
@@ -232,11 +271,15 @@ int main(int argc, char* argv[]) {
     const std::vector<int> sp_sizes = {8, 18, 24};
 //    const std::vector<int> sp_sizes = {6, 8, 12, 18, 24, 32};
 
+    // Size classes no longer need their own segmentation pass, so parallelize over images instead
+    size_t nproc_omp = std::min(omp_get_max_threads(), 16);
+    #pragma omp parallel for num_threads(nproc_omp) default(none) shared(dataset, output, sp_sizes, segmentation_cache)
     for (size_t i = 0; i < images.size(); ++i) {
         const std::string fname = (dataset/images[i]).string();
-        std::cout << "Processing " << fname << std::endl;
-        #pragma omp parallel for default(none) shared(dataset, fname, output, sp_sizes)
-        for (size_t j = 0; j < sp_sizes.size(); ++j)
-            process_tif(dataset, fname, output, chip_overlap, sp_sizes[j]);
+        std::stringstream ss;
+        ss << "tid=" << omp_get_thread_num() << " Processing " << fname << std::endl;
+        std::cout << ss.str();
+        process_tif(dataset, fname, output, chip_overlap, sp_sizes,
+                    segmentation_cache.IsOpen() ? &segmentation_cache : nullptr);
     }
 }
\ No newline at end of file
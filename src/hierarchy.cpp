@@ -0,0 +1,186 @@
+#include <queue>
+#include <algorithm>
+#include <cstdint>
+#include "hierarchy.hpp"
+
+namespace spt {
+    namespace {
+        template<typename T>
+        void accumulate_regions(const cv::Mat &frame, const cv::Mat &labels, std::vector<cv::Vec3d> &color_sum,
+                                std::vector<RegionInfo> &output) {
+            for (int y = 0; y < labels.rows; ++y) {
+                const int *lptr = labels.ptr<int>(y);
+                const T *fptr = frame.ptr<T>(y);
+                for (int x = 0; x < labels.cols; ++x) {
+                    const int l = lptr[x];
+                    CV_DbgAssert(l >= 0 && l < (int) output.size());
+                    color_sum[l][0] += fptr[x * 3];
+                    color_sum[l][1] += fptr[x * 3 + 1];
+                    color_sum[l][2] += fptr[x * 3 + 2];
+                    output[l].area += 1;
+                }
+            }
+        }
+    }
+
+    void ComputeRegionInfo(cv::InputArray _frame, cv::InputArray _labels, unsigned int nsp, std::vector<RegionInfo> &output) {
+        cv::Mat frame = _frame.getMat(), labels = _labels.getMat();
+        CV_Assert((frame.type() == CV_8UC3 || frame.type() == CV_32FC3) && labels.type() == CV_32SC1 &&
+                  frame.size() == labels.size());
+        std::vector<cv::Vec3d> color_sum(nsp, cv::Vec3d(0, 0, 0));
+        output.assign(nsp, RegionInfo());
+        if (frame.depth() == CV_8U)
+            accumulate_regions<unsigned char>(frame, labels, color_sum, output);
+        else
+            accumulate_regions<float>(frame, labels, color_sum, output);
+        for (unsigned int i = 0; i < nsp; ++i) {
+            if (output[i].area > 0)
+                output[i].color = cv::Vec3f(color_sum[i] / output[i].area);
+        }
+    }
+
+    float RegionHierarchy::cost(const RegionInfo &a, const RegionInfo &b) {
+        const cv::Vec3f d = a.color - b.color;
+        return a.area * b.area / (a.area + b.area) * d.dot(d);
+    }
+
+    RegionHierarchy *RegionHierarchy::Compute(cv::InputArray _labels, const std::vector<RegionInfo> &regions) {
+        leaf_labels = _labels.getMat();
+        CV_Assert(leaf_labels.type() == CV_32SC1);
+        num_leaves = static_cast<unsigned int>(regions.size());
+        merges.clear();
+
+        // Region adjacency graph: collect (min, max) label pairs across 4-neighbor boundaries.
+        // Runs along a boundary produce the same pair repeatedly, so only changes are recorded before sort-unique.
+        std::vector<char> present(num_leaves, 0);
+        std::vector<uint64_t> edges;
+        uint64_t last = UINT64_MAX;
+        auto add_edge = [&](int a, int b) {
+            const uint64_t key = a < b ?
+                                 (static_cast<uint64_t>(a) << 32) | static_cast<uint32_t>(b) :
+                                 (static_cast<uint64_t>(b) << 32) | static_cast<uint32_t>(a);
+            if (key != last) edges.push_back(last = key);
+        };
+        for (int y = 0; y < leaf_labels.rows; ++y) {
+            const int *row = leaf_labels.ptr<int>(y);
+            const int *below = y + 1 < leaf_labels.rows ? leaf_labels.ptr<int>(y + 1) : nullptr;
+            for (int x = 0; x < leaf_labels.cols; ++x) {
+                const int l = row[x];
+                CV_Assert(l >= 0 && l < (int) num_leaves);
+                present[l] = 1;
+                if (x + 1 < leaf_labels.cols && row[x + 1] != l) add_edge(l, row[x + 1]);
+                if (below && below[x] != l) add_edge(l, below[x]);
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+        num_present = static_cast<unsigned int>(std::count(present.begin(), present.end(), 1));
+
+        std::vector<std::vector<int>> adjacency(num_leaves);
+        for (const uint64_t key: edges) {
+            const int a = static_cast<int>(key >> 32), b = static_cast<int>(key & 0xffffffffu);
+            adjacency[a].push_back(b);
+            adjacency[b].push_back(a);
+        }
+
+        // Union-find over labels; merged statistics live at the root
+        std::vector<int> parent(num_leaves), version(num_leaves, 0);
+        std::vector<RegionInfo> info(regions);
+        for (unsigned int i = 0; i < num_leaves; ++i) {
+            parent[i] = i;
+            // cluster centers may report stale counts after connectivity enforcement
+            if (info[i].area <= 0) info[i].area = 1;
+        }
+        auto find = [&parent](int i) {
+            while (parent[i] != i) i = parent[i] = parent[parent[i]];
+            return i;
+        };
+
+        // Min-heap with lazy invalidation: an entry is stale once either endpoint has merged since it was pushed
+        struct Entry {
+            float cost;
+            int a, b, va, vb;
+
+            bool operator<(const Entry &other) const { return cost > other.cost; }
+        };
+        std::priority_queue<Entry> heap;
+        for (const uint64_t key: edges) {
+            const int a = static_cast<int>(key >> 32), b = static_cast<int>(key & 0xffffffffu);
+            heap.push({cost(info[a], info[b]), a, b, 0, 0});
+        }
+
+        merges.reserve(num_present > 0 ? num_present - 1 : 0);
+        while (!heap.empty()) {
+            const Entry e = heap.top();
+            heap.pop();
+            if (parent[e.a] != e.a || parent[e.b] != e.b || version[e.a] != e.va || version[e.b] != e.vb)
+                continue;
+
+            // keep the region with the longer neighbor list as root so adjacency merges stay cheap
+            int into = e.a, from = e.b;
+            if (adjacency[into].size() < adjacency[from].size()) std::swap(into, from);
+            RegionInfo &r = info[into];
+            const RegionInfo &s = info[from];
+            const float area = r.area + s.area;
+            r.color = (r.color * r.area + s.color * s.area) / area;
+            r.area = area;
+            parent[from] = into;
+            ++version[into];
+            merges.push_back({into, from, e.cost});
+
+            std::vector<int> &neighbors = adjacency[into];
+            neighbors.insert(neighbors.end(), adjacency[from].begin(), adjacency[from].end());
+            std::vector<int>().swap(adjacency[from]);
+            for (int &n: neighbors) n = find(n);
+            std::sort(neighbors.begin(), neighbors.end());
+            neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+            neighbors.erase(std::remove(neighbors.begin(), neighbors.end(), into), neighbors.end());
+            for (const int n: neighbors)
+                heap.push({cost(r, info[n]), into, n, version[into], version[n]});
+        }
+        return this;
+    }
+
+    unsigned int RegionHierarchy::GetLabels(unsigned int num_regions, cv::OutputArray output) const {
+        const size_t num_merges = num_regions >= num_present ? 0 :
+                                  std::min<size_t>(num_present - std::max(num_regions, 1u), merges.size());
+        std::vector<int> parent(num_leaves);
+        for (unsigned int i = 0; i < num_leaves; ++i) parent[i] = i;
+        for (size_t i = 0; i < num_merges; ++i)
+            parent[merges[i].from] = merges[i].into;
+
+        // Relabel roots contiguously in the order they first appear in the leaf labels
+        std::vector<int> lut(num_leaves, -1), root_label(num_leaves, -1);
+        int next_label = 0;
+        for (unsigned int i = 0; i < num_leaves; ++i) {
+            int root = i;
+            while (parent[root] != root) root = parent[root];
+            parent[i] = root;
+        }
+
+        output.create(leaf_labels.size(), CV_32SC1);
+        cv::Mat outmat = output.getMat();
+        for (int y = 0; y < leaf_labels.rows; ++y) {
+            const int *iptr = leaf_labels.ptr<int>(y);
+            int *optr = outmat.ptr<int>(y);
+            for (int x = 0; x < leaf_labels.cols; ++x) {
+                int &l = lut[iptr[x]];
+                if (l < 0) {
+                    int &r = root_label[parent[iptr[x]]];
+                    if (r < 0) r = next_label++;
+                    l = r;
+                }
+                optr[x] = l;
+            }
+        }
+        return static_cast<unsigned int>(next_label);
+    }
+
+    unsigned int RegionHierarchy::GetNumSuperpixels() const {
+        return num_present;
+    }
+
+    const std::vector<RegionHierarchy::Merge> &RegionHierarchy::GetMerges() const {
+        return merges;
+    }
+}
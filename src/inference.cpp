@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include "inference.hpp"
+
+namespace spt::dnn {
+    double InferenceService::Metrics::MeanBatchSize() const {
+        return batches == 0 ? 0.0 : static_cast<double>(requests - failed) / batches;
+    }
+
+    void InferenceService::Metrics::Print(std::ostream &os) const {
+        os << "Inference: " << requests << " requests in " << batches << " batches (mean batch size "
+           << MeanBatchSize() << ", max queue depth " << max_queue_depth << ", failed " << failed << ")" << std::endl;
+        for (size_t n = 1; n < batch_sizes.size(); ++n) {
+            if (batch_sizes[n] > 0)
+                os << "  batch size " << n << ": " << batch_sizes[n] << std::endl;
+        }
+    }
+
+    InferenceService::InferenceService(IComputeFrameSuperpixel *model, int max_batch_size,
+                                       std::chrono::microseconds max_wait) :
+            InferenceService(std::vector<IComputeFrameSuperpixel *>{model}, max_batch_size, max_wait) {
+    }
+
+    InferenceService::InferenceService(const std::vector<IComputeFrameSuperpixel *> &models, int max_batch_size,
+                                       std::chrono::microseconds max_wait) :
+            models(models),
+            max_batch_size(std::max(std::min(max_batch_size, models.at(0)->GetBatchSize()), 1)),
+            max_wait(max_wait),
+            feature_dim(models.at(0)->GetFeatureDim()),
+            nsp(models.at(0)->GetNSP()) {
+        metrics.batch_sizes.assign(this->max_batch_size + 1, 0);
+        for (IComputeFrameSuperpixel *model: models)
+            executors.emplace_back(&InferenceService::run, this, model);
+    }
+
+    InferenceService::~InferenceService() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queue_cv.notify_all();
+        for (std::thread &executor: executors) {
+            if (executor.joinable()) executor.join();
+        }
+    }
+
+    std::future<FeatureBlock> InferenceService::Submit(const cv::Mat &frame, const cv::Mat &superpixels,
+                                                       std::vector<int> ids) {
+        std::future<std::vector<FeatureBlock>> blocks = Submit(frame, std::vector<cv::Mat>{superpixels},
+                                                               std::vector<std::vector<int>>{std::move(ids)});
+        // unwrapped on get(), in the caller's thread
+        return std::async(std::launch::deferred, [blocks = std::move(blocks)]() mutable {
+            return std::move(blocks.get().at(0));
+        });
+    }
+
+    std::future<std::vector<FeatureBlock>> InferenceService::Submit(const cv::Mat &frame,
+                                                                    const std::vector<cv::Mat> &label_maps,
+                                                                    std::vector<std::vector<int>> ids) {
+        CV_Assert(!label_maps.empty() && ids.size() == label_maps.size());
+        Request request{frame, label_maps, std::move(ids), std::promise<std::vector<FeatureBlock>>(),
+                        std::chrono::steady_clock::now()};
+        std::future<std::vector<FeatureBlock>> future = request.promise.get_future();
+        if (label_maps.size() > 1 && !models[0]->SharesTrunk()) {
+            request.promise.set_exception(std::make_exception_ptr(
+                    std::runtime_error("DCNN pools one label map per frame; see SharesTrunk()")));
+            return future;
+        }
+        // a bad id fails its own request here rather than the executor's whole batch
+        const int max_id = GetNSP();
+        for (const std::vector<int> &label_ids: request.ids) {
+            for (const int id: label_ids) {
+                if (id < 0 || id >= max_id) {
+                    request.promise.set_exception(std::make_exception_ptr(std::out_of_range(
+                            "Superpixel " + std::to_string(id) + " is outside the DCNN's " +
+                            std::to_string(max_id) + " superpixels")));
+                    return future;
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) {
+                request.promise.set_exception(
+                        std::make_exception_ptr(std::runtime_error("InferenceService is shutting down")));
+                return future;
+            }
+            queue.push_back(std::move(request));
+            ++metrics.requests;
+            metrics.max_queue_depth = std::max(metrics.max_queue_depth, queue.size());
+        }
+        queue_cv.notify_all();
+        return future;
+    }
+
+    int InferenceService::GetFeatureDim() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return feature_dim;
+    }
+
+    int InferenceService::GetNSP() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return nsp;
+    }
+
+    int InferenceService::GetMaxBatchSize() const {
+        return max_batch_size;
+    }
+
+    size_t InferenceService::GetQueueDepth() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    InferenceService::Metrics InferenceService::GetMetrics() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return metrics;
+    }
+
+    void InferenceService::run(IComputeFrameSuperpixel *model) {
+        std::vector<Request> batch;
+        std::vector<cv::Mat> frames, superpixels;
+        std::vector<std::vector<FeatureBlock>> results;
+        batch.reserve(max_batch_size);
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            queue_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) break; // stopping with nothing left to do
+
+            // Give the batch until max_wait past its oldest request to fill up; don't wait while shutting down
+            const auto deadline = queue.front().arrival + max_wait;
+            queue_cv.wait_until(lock, deadline, [this] {
+                return stopping || queue.size() >= (size_t) max_batch_size;
+            });
+
+            // ComputeBatch takes the same number of label maps for every frame
+            const size_t k = queue.front().superpixels.size();
+            batch.clear();
+            while (!queue.empty() && batch.size() < (size_t) max_batch_size && queue.front().superpixels.size() == k) {
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            const size_t n = batch.size();
+            ++metrics.batches;
+            ++metrics.batch_sizes[n];
+            lock.unlock();
+
+            frames.clear();
+            superpixels.clear();
+            results.resize(n);
+            for (const Request &request: batch) {
+                frames.push_back(request.frame);
+                superpixels.insert(superpixels.end(), request.superpixels.begin(), request.superpixels.end());
+            }
+            // Features are copied out before any promise completes, so a failure never leaves a batch half-done
+            std::exception_ptr error;
+            int batch_feature_dim = 0, batch_nsp = 0;
+            try {
+                if (model->ComputeBatch(frames, superpixels)) {
+                    batch_feature_dim = model->GetFeatureDim();
+                    batch_nsp = model->GetNSP();
+                    for (size_t i = 0; i < n; ++i) {
+                        results[i].resize(k);
+                        for (size_t j = 0; j < k; ++j) {
+                            const std::vector<int> &ids = batch[i].ids[j];
+                            FeatureBlock &block = results[i][j];
+                            const int label_map = (int) (i * k + j);
+                            if (ids.empty()) {
+                                block.resize((size_t) batch_feature_dim * batch_nsp);
+                                model->GetBatchFeature(label_map, block.data());
+                            } else {
+                                block.resize((size_t) batch_feature_dim * ids.size());
+                                model->GetBatchFeatures(label_map, ids, block.data());
+                            }
+                        }
+                    }
+                } else {
+                    error = std::make_exception_ptr(std::runtime_error("DCNN inference failed"));
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+            {
+                std::lock_guard<std::mutex> metrics_lock(mutex);
+                if (error) {
+                    metrics.failed += n;
+                } else {
+                    feature_dim = batch_feature_dim;
+                    nsp = batch_nsp;
+                }
+            }
+            for (size_t i = 0; i < n; ++i) {
+                if (error) batch[i].promise.set_exception(error);
+                else batch[i].promise.set_value(std::move(results[i]));
+            }
+            lock.lock();
+        }
+    }
+}
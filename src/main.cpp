@@ -8,6 +8,7 @@
 #include "misc_ocv.hpp"
 #include "misc_os.hpp"
 #include "superpixel.hpp"
+#include "spindex.hpp"
 #include "dcnn.hpp"
 
 #if __has_include(<filesystem>)
@@ -84,7 +85,7 @@ public:
                                          .seg_method = gSLICr::GIVEN_SIZE // gSLICr::GIVEN_NUM
                                  });
 #else
-        _superpixel = spt::OpenCVSLIC(32, 30.0f, 3, 10.0f);
+        _superpixel = spt::OpenCVSLIC(32, 30.0f, 3, 10.0f, cv::ximgproc::SLICO, true);
 #endif
         dcnn.Summary();
         dcnn.NewSession();
@@ -102,8 +103,9 @@ public:
         frame_dcnn = frame_rgb.clone();
         spt::ISuperpixel *superpixel = _superpixel.Compute(frame);
         superpixel->GetLabels(superpixel_labels);
+        superpixel_index.Compute(superpixel_labels);
         superpixel_id = superpixel_labels.at<unsigned int>(pointer_y, pointer_x);
-        sel.superpixel_selected = superpixel_labels == superpixel_id;
+        superpixel_index.GetMask(superpixel_id, sel.superpixel_selected);
         switch (sel.mode) {
             case SuperpixelSelection::Mode::None:
                 break;
@@ -142,7 +144,7 @@ public:
                 float zoom = 4.0f;
                 ImGui::Text("Ptr: (%d,%d) Id: %d", pointer_x, pointer_y, superpixel_id);
                 cv::Scalar sel_mean, sel_std;
-                cv::meanStdDev(frame_rgb, sel_mean, sel_std, sel.superpixel_selected);
+                superpixel_index.MeanStdDev(frame_rgb, superpixel_id, sel_mean, sel_std);
                 ImGui::Text("Mean: (%.1f,%.1f,%.1f)", sel_mean[0], sel_mean[1], sel_mean[2]);
                 ImGui::Text("Std: (%.1f,%.1f,%.1f)", sel_std[0], sel_std[1], sel_std[2]);
                 ImGui::Image(
@@ -242,6 +244,7 @@ protected:
 
     cv::Mat frame, frame_rgb, frame_dcnn;
     cv::Mat superpixel_labels;
+    spt::SuperpixelIndex superpixel_index;
 //    cv::Mat superpixel_contour, superpixel_labels, superpixel_selected;
 //    std::vector<std::vector<cv::Point>> superpixel_sel_contour;
     cv::Moments superpixel_moments;
@@ -346,7 +349,7 @@ order by st_area(bbox.xview_bounds_imcoords);");
                                          .seg_method = gSLICr::GIVEN_SIZE // gSLICr::GIVEN_NUM
                                  });
 #else
-        _superpixel = spt::OpenCVSLIC(superpixel_size, 30.0f, 3, 10.0f);
+        _superpixel = spt::OpenCVSLIC(superpixel_size, 30.0f, 3, 10.0f, cv::ximgproc::SLICO, true);
 #endif
 
         if (analyzer_config.dcnn_enable) {
@@ -405,8 +408,9 @@ order by st_area(bbox.xview_bounds_imcoords);");
         cv::cvtColor(frame, frame_rgb, cv::COLOR_BGR2RGB);
         frame_dcnn = frame_rgb.clone();
 
+        superpixel_index.Compute(superpixel_labels);
         superpixel_id = superpixel_labels.at<unsigned int>(pointer_y, pointer_x);
-        sel.superpixel_selected = superpixel_labels == superpixel_id;
+        superpixel_index.GetMask(superpixel_id, sel.superpixel_selected);
         switch (sel.mode) {
             case SuperpixelSelection::Mode::None:
                 break;
@@ -451,7 +455,7 @@ order by st_area(bbox.xview_bounds_imcoords);");
                 float zoom = 4.0f;
                 ImGui::Text("Ptr: (%d,%d) Id: %d", pointer_x, pointer_y, superpixel_id);
                 cv::Scalar sel_mean, sel_std;
-                cv::meanStdDev(frame_rgb, sel_mean, sel_std, sel.superpixel_selected);
+                superpixel_index.MeanStdDev(frame_rgb, superpixel_id, sel_mean, sel_std);
                 ImGui::Text("Mean: (%.1f,%.1f,%.1f)", sel_mean[0], sel_mean[1], sel_mean[2]);
                 ImGui::Text("Std: (%.1f,%.1f,%.1f)", sel_std[0], sel_std[1], sel_std[2]);
                 ImGui::Image(
@@ -519,10 +523,14 @@ order by st_area(bbox.xview_bounds_imcoords);");
 
         if (analyzer_config.dcnn_enable && ImGui::TreeNode("Superpixel DCNN Features")) {
             dcnn.Compute(frame_dcnn, superpixel_labels);
-            superpixel_feature_buffer.resize(dcnn.GetFeatureDim());
-            dcnn.GetFeature(superpixel_id, superpixel_feature_buffer.data());
-            ImGui::PlotLines("Feature", superpixel_feature_buffer.data(), dcnn.GetFeatureDim(), 0, "", -1.0f, 1.0f,
-                             ImVec2(320, 200));
+            if ((int) superpixel_id < dcnn.GetNSP()) {
+                superpixel_feature_buffer.resize(dcnn.GetFeatureDim());
+                dcnn.GetFeature(superpixel_id, superpixel_feature_buffer.data());
+                ImGui::PlotLines("Feature", superpixel_feature_buffer.data(), dcnn.GetFeatureDim(), 0, "", -1.0f, 1.0f,
+                                 ImVec2(320, 200));
+            } else {
+                ImGui::Text("Superpixel %d is beyond the model's %d", (int) superpixel_id, dcnn.GetNSP());
+            }
             ImGui::TreePop();
         }
 
@@ -607,6 +615,7 @@ protected:
 
     cv::Mat frame_raw, frame, frame_rgb, frame_dcnn;
     cv::Mat superpixel_labels;
+    spt::SuperpixelIndex superpixel_index;
 //    cv::Mat superpixel_contour, superpixel_labels, superpixel_selected;
 //    std::vector<std::vector<cv::Point>> superpixel_sel_contour;
     cv::Moments superpixel_moments;
@@ -1,4 +1,6 @@
 #include <iostream>
+#include <cstring>
+#include <opencv2/core/hal/intrin.hpp>
 #include "misc_ocv.hpp"
 
 using namespace std;
@@ -21,6 +23,44 @@ namespace cv_misc {
         }
     }
 
+    void ResizeNearestLabels(InputArray _input, OutputArray _output, Size size) {
+        Mat input = _input.getMat();
+        CV_Assert(input.type() == CV_32SC1 && !size.empty());
+        if (input.size() == size) {
+            input.copyTo(_output);
+            return;
+        }
+        _output.create(size, CV_32SC1);
+        Mat output = _output.getMat();
+
+        // Source column of every output column, computed once and gathered per row; the offsets are rounded the
+        // way cv::resize rounds them for INTER_NEAREST
+        const double ifx = 1. / ((double) size.width / input.cols), ify = 1. / ((double) size.height / input.rows);
+        vector<int> xofs(size.width);
+        for (int x = 0; x < size.width; ++x)
+            xofs[x] = std::min(cvFloor(x * ifx), input.cols - 1);
+
+        int prev_sy = -1;
+        for (int y = 0; y < size.height; ++y) {
+            const int sy = std::min(cvFloor(y * ify), input.rows - 1);
+            int *optr = output.ptr<int>(y);
+            // upscaling maps consecutive rows to the same source row: duplicate the row instead of gathering again
+            if (sy == prev_sy) {
+                std::memcpy(optr, output.ptr<int>(y - 1), size.width * sizeof(int));
+                continue;
+            }
+            prev_sy = sy;
+            const int *iptr = input.ptr<int>(sy);
+            int x = 0;
+#if CV_SIMD
+            for (; x <= size.width - v_int32::nlanes; x += v_int32::nlanes)
+                v_store(optr + x, v_lut(iptr, xofs.data() + x));
+#endif
+            for (; x < size.width; ++x)
+                optr[x] = iptr[xofs[x]];
+        }
+    }
+
     bool CameraInfo::Acquire() {
         return isOpened == false ? (isOpened = true) : false;
     }
@@ -1,6 +1,10 @@
 #include "misc_os.hpp"
 #include <iostream>
 #include <cstring>
+#include <algorithm>
+extern "C" {
+#include <sys/file.h>
+}
 namespace os_misc {
 
     Glob::Glob(const char *pattern) {
@@ -78,4 +82,194 @@ namespace os_misc {
         ::sem_destroy(&_sem);
     }
 
-}
\ No newline at end of file
+
+    uint64_t FNV1a(const void *data, size_t size, uint64_t hash) {
+        const auto *p = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= p[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    uint64_t HashFile(const char *path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return 0;
+        struct stat st;
+        uint64_t hash = 0;
+        if (::fstat(fd, &st) == 0) {
+            if (st.st_size == 0) {
+                hash = FNV1aOffset;
+            } else {
+                void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                    ::madvise(data, st.st_size, MADV_SEQUENTIAL);
+                    hash = FNV1a(data, st.st_size);
+                    ::munmap(data, st.st_size);
+                }
+            }
+        }
+        ::close(fd);
+        return hash;
+    }
+
+    namespace {
+        constexpr char StoreMagic[8] = {'S', 'P', 'T', 'R', 'E', 'C', '0', '1'};
+        constexpr uint32_t RecordMagic = 0x52505353;
+
+        /// First mapping of a store, in bytes; address space only, nothing is read past EOF
+        constexpr uint64_t MinMapSize = 1 << 20;
+
+        inline uint64_t pad8(uint64_t size) {
+            return (size + 7) & ~(uint64_t) 7;
+        }
+
+        bool write_all(int fd, const void *data, size_t size, off_t offset) {
+            const auto *p = static_cast<const char *>(data);
+            while (size > 0) {
+                const ssize_t written = ::pwrite(fd, p, size, offset);
+                if (written <= 0) return false;
+                p += written;
+                size -= written;
+                offset += written;
+            }
+            return true;
+        }
+    }
+
+    RecordStore::~RecordStore() {
+        Close();
+    }
+
+    bool RecordStore::Open(const std::string &path, bool writable) {
+        Close();
+        std::lock_guard<std::mutex> lock(mutex);
+        fd = writable ? ::open(path.c_str(), O_RDWR | O_CREAT, 0644) : ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Cannot open record store " << path << std::endl;
+            return false;
+        }
+        this->writable = writable;
+        ::flock(fd, writable ? LOCK_EX : LOCK_SH);
+        struct stat st;
+        bool ok = ::fstat(fd, &st) == 0;
+        if (ok && st.st_size == 0 && writable) {
+            ok = write_all(fd, StoreMagic, sizeof(StoreMagic), 0);
+            st.st_size = sizeof(StoreMagic);
+        }
+        ok = ok && st.st_size >= (off_t) sizeof(StoreMagic) && remap(st.st_size) &&
+             std::memcmp(map, StoreMagic, sizeof(StoreMagic)) == 0;
+        if (ok) {
+            end = sizeof(StoreMagic);
+            scan(st.st_size);
+            if (end < (uint64_t) st.st_size && writable) {
+                std::cerr << "Dropping " << st.st_size - end << " bytes of an incomplete record from " << path
+                          << std::endl;
+                ok = ::ftruncate(fd, end) == 0;
+            }
+        }
+        ::flock(fd, LOCK_UN);
+        if (!ok) {
+            std::cerr << path << " is not a record store" << std::endl;
+            ::close(fd);
+            fd = -1;
+        }
+        return ok;
+    }
+
+    void RecordStore::Close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (map) ::munmap(const_cast<char *>(map), map_size);
+        for (auto const &r: retired) ::munmap(const_cast<char *>(r.first), r.second);
+        retired.clear();
+        map = nullptr;
+        map_size = 0;
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        index.clear();
+        records = 0;
+        end = 0;
+    }
+
+    bool RecordStore::IsOpen() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return fd >= 0;
+    }
+
+    size_t RecordStore::size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return records;
+    }
+
+    bool RecordStore::remap(uint64_t size) {
+        if (size <= map_size) return true;
+        // Capacity doubles past EOF, so a store of n records is mapped O(log n) times and the retired mappings
+        // add up to less than the live one. Pages past EOF are never read: scan() and Find() stop at `end`.
+        const uint64_t capacity = std::max({size, (uint64_t) map_size * 2, MinMapSize});
+        void *data = ::mmap(nullptr, capacity, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) return false;
+        // the old mapping stays until Close(): callers may hold pointers into it
+        if (map) retired.emplace_back(map, map_size);
+        map = static_cast<const char *>(data);
+        map_size = capacity;
+        return true;
+    }
+
+    void RecordStore::scan(uint64_t to) {
+        while (end + sizeof(RecordHeader) <= to) {
+            RecordHeader header;
+            std::memcpy(&header, map + end, sizeof(header));
+            const uint64_t total = sizeof(RecordHeader) + pad8(header.key_size) + pad8(header.data_size);
+            if (header.magic != RecordMagic || header.data_size > to || end + total > to) break;
+            if (FNV1a(map + end + sizeof(RecordHeader), header.key_size) != header.hash) break;
+            index[header.hash].push_back(end);
+            ++records;
+            end += total;
+        }
+    }
+
+    bool RecordStore::Find(const std::string &key, const void *&data, size_t &size) {
+        const uint64_t hash = FNV1a(key.data(), key.size());
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(hash);
+        if (it == index.end()) return false;
+        for (auto offset = it->second.rbegin(); offset != it->second.rend(); ++offset) {
+            RecordHeader header;
+            std::memcpy(&header, map + *offset, sizeof(header));
+            const char *record_key = map + *offset + sizeof(RecordHeader);
+            if (header.key_size != key.size() || std::memcmp(record_key, key.data(), key.size()) != 0) continue;
+            data = record_key + pad8(header.key_size);
+            size = header.data_size;
+            return true;
+        }
+        return false;
+    }
+
+    bool RecordStore::Append(const std::string &key, const void *data, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fd < 0 || !writable) return false;
+        ::flock(fd, LOCK_EX);
+        // pick up what other processes appended since; writers hold the lock, so a partial record left over is torn
+        struct stat st;
+        bool ok = ::fstat(fd, &st) == 0;
+        if (ok && (uint64_t) st.st_size > end && remap(st.st_size)) scan(st.st_size);
+        if (ok && (uint64_t) st.st_size > end) ok = ::ftruncate(fd, end) == 0;
+        const uint64_t offset = end;
+
+        RecordHeader header{RecordMagic, static_cast<uint32_t>(key.size()), size, FNV1a(key.data(), key.size())};
+        const uint64_t key_end = offset + sizeof(RecordHeader) + pad8(key.size());
+        const uint64_t total = key_end + pad8(size) - offset;
+        static const char zeros[8] = {};
+        // the header goes last, so a record is only found once it is complete
+        ok = ok && write_all(fd, key.data(), key.size(), offset + sizeof(RecordHeader)) &&
+             write_all(fd, zeros, pad8(key.size()) - key.size(), offset + sizeof(RecordHeader) + key.size()) &&
+             write_all(fd, data, size, key_end) && write_all(fd, zeros, pad8(size) - size, key_end + size) &&
+             write_all(fd, &header, sizeof(header), offset) && remap(offset + total);
+        ::flock(fd, LOCK_UN);
+        if (!ok) return false;
+        index[header.hash].push_back(offset);
+        ++records;
+        end = offset + total;
+        return true;
+    }
+}
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <opencv2/core/hal/intrin.hpp>
+#include "pooling.hpp"
+
+namespace spt::dnn {
+    namespace {
+        /// acc[c] += weight * f[c]
+        inline void accumulate_sum(float *acc, const float *f, float weight, int channels) {
+            int c = 0;
+#if CV_SIMD
+            const cv::v_float32 w = cv::vx_setall_f32(weight);
+            for (; c <= channels - cv::v_float32::nlanes; c += cv::v_float32::nlanes)
+                cv::v_store(acc + c, cv::v_muladd(cv::vx_load(f + c), w, cv::vx_load(acc + c)));
+#endif
+            for (; c < channels; ++c)
+                acc[c] += weight * f[c];
+        }
+
+        /// acc[c] = max(acc[c], f[c])
+        inline void accumulate_max(float *acc, const float *f, int channels) {
+            int c = 0;
+#if CV_SIMD
+            for (; c <= channels - cv::v_float32::nlanes; c += cv::v_float32::nlanes)
+                cv::v_store(acc + c, cv::v_max(cv::vx_load(f + c), cv::vx_load(acc + c)));
+#endif
+            for (; c < channels; ++c)
+                acc[c] = std::max(acc[c], f[c]);
+        }
+    }
+
+    SuperpixelPooling::SuperpixelPooling(int modes) : modes(modes) {
+        CV_Assert((modes & (Average | Max)) != 0);
+    }
+
+    int SuperpixelPooling::GetFeatureDim(int channels) const {
+        return channels * (((modes & Average) ? 1 : 0) + ((modes & Max) ? 1 : 0));
+    }
+
+    void SuperpixelPooling::Compute(const FeatureMap &features, cv::InputArray _labels, unsigned int nsp,
+                                    float *output, size_t output_step) {
+        cv::Mat labels = _labels.getMat();
+        CV_Assert(labels.type() == CV_32SC1 && features.data && features.height > 0 && features.width > 0);
+        xofs.resize(labels.cols);
+        for (int x = 0; x < labels.cols; ++x)
+            xofs[x] = std::min(static_cast<int>(static_cast<int64_t>(x) * features.width / labels.cols),
+                               features.width - 1);
+        yofs.resize(labels.rows);
+        for (int y = 0; y < labels.rows; ++y)
+            yofs[y] = std::min(static_cast<int>(static_cast<int64_t>(y) * features.height / labels.rows),
+                               features.height - 1);
+        pool(features, labels, nsp, output, output_step);
+    }
+
+    void SuperpixelPooling::Compute(const FeatureMap &features, cv::InputArray _labels, cv::Point origin, int stride,
+                                    unsigned int nsp, float *output, size_t output_step) {
+        cv::Mat labels = _labels.getMat();
+        CV_Assert(labels.type() == CV_32SC1 && features.data && features.height > 0 && features.width > 0);
+        CV_Assert(stride > 0 && origin.x >= 0 && origin.y >= 0);
+        xofs.resize(labels.cols);
+        for (int x = 0; x < labels.cols; ++x)
+            xofs[x] = std::min((origin.x + x) / stride, features.width - 1);
+        yofs.resize(labels.rows);
+        for (int y = 0; y < labels.rows; ++y)
+            yofs[y] = std::min((origin.y + y) / stride, features.height - 1);
+        pool(features, labels, nsp, output, output_step);
+    }
+
+    void SuperpixelPooling::pool(const FeatureMap &features, const cv::Mat &labels, unsigned int nsp, float *output,
+                                 size_t output_step) {
+        const int channels = features.channels, dim = GetFeatureDim(channels);
+        const size_t step = output_step > 0 ? output_step : (size_t) dim;
+        CV_Assert(step >= (size_t) dim);
+        const int avg_offset = 0, max_offset = (modes & Average) ? channels : 0;
+
+        counts.assign(nsp, 0);
+        for (unsigned int l = 0; l < nsp; ++l) {
+            float *acc = output + (size_t) l * step;
+            std::fill_n(acc, dim, 0.0f);
+            if (modes & Max) std::fill_n(acc + max_offset, channels, -std::numeric_limits<float>::infinity());
+        }
+
+        // Runs of one label inside one feature cell are accumulated at once
+        for (int y = 0; y < labels.rows; ++y) {
+            const int cy = yofs[y];
+            const int *lptr = labels.ptr<int>(y);
+            for (int x = 0; x < labels.cols;) {
+                const int l = lptr[x], cx = xofs[x];
+                int x1 = x + 1;
+                while (x1 < labels.cols && lptr[x1] == l && xofs[x1] == cx) ++x1;
+                if (l >= 0 && l < (int) nsp) {
+                    const float *f = features.at(cy, cx);
+                    float *acc = output + (size_t) l * step;
+                    counts[l] += x1 - x;
+                    if (modes & Average) accumulate_sum(acc + avg_offset, f, (float) (x1 - x), channels);
+                    if (modes & Max) accumulate_max(acc + max_offset, f, channels);
+                }
+                x = x1;
+            }
+        }
+
+        for (unsigned int l = 0; l < nsp; ++l) {
+            float *acc = output + (size_t) l * step;
+            if (counts[l] == 0) {
+                std::fill_n(acc, dim, 0.0f);
+                continue;
+            }
+            if (modes & Average) {
+                const float inv = 1.0f / counts[l];
+                for (int c = 0; c < channels; ++c) acc[avg_offset + c] *= inv;
+            }
+        }
+    }
+}
@@ -1,18 +1,28 @@
 #include <string>
 #include <thread>
+#include <mutex>
+#include <future>
 #include <iostream>
 #include <sstream>
+#include <numeric>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <pqxx/pqxx>
+#ifdef HAS_TF
 #include <tensorflow/core/public/session.h>
+#endif
 #include <omp.h>
 #include "argparse.hpp"
 #include "misc_os.hpp"
 #include "misc_ocv.hpp"
 #include "superpixel.hpp"
+#include "spindex.hpp"
+#include "bboxindex.hpp"
+#include "segcache.hpp"
 #include "dcnn.hpp"
+#include "inference.hpp"
 #include "saver.hpp"
+#include "build_vars.hpp"
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -22,34 +32,54 @@ namespace fs = std::filesystem;
 namespace fs = std::experimental::filesystem;
 #endif
 
+#ifdef HAS_TF
 namespace tf = tensorflow;
+#endif
+
+/// --fcn: the conv trunk runs once per frame in tiles, and chips pool their superpixels from crops of its feature map
+struct FullyConvolutional {
+    spt::dnn::IComputeFeatureMap *trunk = nullptr;
+    std::mutex *trunk_mutex = nullptr;
+    int tile_size = 1024, halo = 128;
+    int pooling_modes = spt::dnn::SuperpixelPooling::Average;
+    unsigned int nsp = 1024;
+};
 
-void process_tif(const fs::path &dataset, const std::string &fname, spt::dnn::IComputeFrameSuperpixel *dcnn, const float chip_overlap, const std::string &dcnn_name, const int sp_size, bool verbose = false) {
+/// One DCNN fed from the shared decode and segmentation of a frame; its rows are tagged with dcnn_name
+struct DCNNRun {
+    std::string dcnn_name;
+    /// Everything besides the input that decides the features (model, precision, pooling, layers), for cache keys
+    std::string signature;
+    spt::dnn::InferenceService *inference = nullptr;
+    /// --fcn: the frame's trunk, otherwise chips are submitted to the inference service
+    const FullyConvolutional *fcn = nullptr;
+};
+
+void process_tif(const fs::path &dataset, const std::string &fname, const std::vector<DCNNRun> &dcnns, const float chip_overlap, const std::string &sp_backend, const std::vector<int> &sp_sizes, const int chip_size, os_misc::RecordStore *feature_cache, spt::SegmentationCache *segmentation_cache, bool verbose = false) {
     cv::Mat frame_raw = cv::imread(fname, cv::IMREAD_COLOR);
     cv::Size real_size = frame_raw.size();
-    const int width = 256, height = 256, size_class = sp_size;
+    // chips are segmented at full resolution; the DCNN resamples image and labels to its own input size
+    const int width = chip_size, height = chip_size;
     cv_misc::Chipping chips(real_size, cv::Size(width, height), chip_overlap);
 
-    spt::GSLIC _superpixel({
-                                   .img_size = { width, height },
-                                   .no_segs = 64,
-                                   .spixel_size = size_class,
-                                   .no_iters = 5,
-                                   .coh_weight = 0.6f,
-                                   .do_enforce_connectivity = true,
-                                   .color_space = gSLICr::CIELAB,
-                                   .seg_method = gSLICr::GIVEN_SIZE
-                           });
+    // One segmentation per size class; the DCNN trunk runs once per chip and is pooled with each label map
+    const int num_sizes = static_cast<int>(sp_sizes.size());
+    std::vector<std::unique_ptr<spt::ISuperpixel>> _superpixels;
+    for(const int size_class: sp_sizes)
+        _superpixels.push_back(spt::SuperpixelRegistry::Instance().Create(
+                sp_backend, {.size = {width, height}, .superpixel_size = size_class, .num_iter = 5}));
 
     try{
         pqxx::connection conn("dbname=xview user=postgres");
         fs::path pthFname(fname);
         conn.prepare("sql_find_frame_id", "select id from frame where image = $1");
-        conn.prepare("sql_match_bbox2", // (image, cx, cy)
-                     "select image, class_label.label_name, bbox.xview_type_id, bbox.xview_bounds_imcoords \
-from frame join bbox on frame.id = bbox.frame_id join class_label on bbox.xview_type_id = class_label.id \
-where frame.image = $1 and st_point($2, $3) && bbox.xview_bounds_imcoords \
-order by st_area(bbox.xview_bounds_imcoords);");
+        conn.prepare("sql_frame_bboxes", // (frame_id)
+                     "select class_label.label_name, bbox.xview_type_id, \
+ST_XMin(bbox.xview_bounds_imcoords) as xmin, ST_YMin(bbox.xview_bounds_imcoords) as ymin, \
+ST_XMax(bbox.xview_bounds_imcoords) as xmax, ST_YMax(bbox.xview_bounds_imcoords) as ymax, \
+st_area(bbox.xview_bounds_imcoords) as area \
+from bbox join class_label on bbox.xview_type_id = class_label.id \
+where bbox.frame_id = $1 and bbox.xview_bounds_imcoords is not null;");
         pqxx::work w_frame(conn);
 #if __has_include(<filesystem>)
         std::string image = fs::path(fname).lexically_relative(dataset).string();
@@ -72,27 +102,60 @@ order by st_area(bbox.xview_bounds_imcoords);");
 
         int frame_id = r[0][0].as<int>();
 
-        cv::Mat frame, superpixel_labels, superpixel_selected, frame_dcnn;
-        cv::Rect roi;
+        // Every bbox of the frame in one query; superpixel centroids are matched against them locally
+        spt::BBoxIndex bbox_index;
+        {
+            pqxx::work w_bbox(conn);
+            r = w_bbox.exec_prepared("sql_frame_bboxes", frame_id);
+            w_bbox.commit();
+            std::vector<spt::LabelledBBox> bboxes;
+            for(auto const &row: r)
+                bboxes.push_back({row["xmin"].as<double>(), row["ymin"].as<double>(), row["xmax"].as<double>(), row["ymax"].as<double>(),
+                                  row["area"].as<double>(), row["xview_type_id"].as<int>(), row["label_name"].as<std::string>()});
+            bbox_index.Compute(std::move(bboxes));
+        }
+        std::vector<int> bbox_matches;
+
+        cv::Mat superpixel_selected;
+        cv::Rect roi, superpixel_roi;
         std::vector<std::vector<cv::Point>> superpixel_sel_contour;
         cv::Moments superpixel_moments;
-        std::vector<float> superpixel_feature_buffer;
-        superpixel_feature_buffer.resize(dcnn->GetFeatureDim() * dcnn->GetNSP());
-        std::string superpixel_feature_strbuffer;
-
-        unsigned long ct_superpixel = 0;
-        for(int chip_id = 0; chip_id<chips.nchip; ++chip_id) {
-            roi = chips.GetROI(chip_id);
-            frame = frame_raw(roi);
-            spt::ISuperpixel *superpixel = _superpixel.Compute(frame);
-            ct_superpixel += superpixel->GetNumSuperpixels();
+
+        // Estimated from the grid each size class seeds per chip; chips are segmented only once, in the main loop,
+        // which counts the actual superpixels as it goes
+        unsigned long ct_superpixel = 0, ct_estimate = 0;
+        for(const int size_class: sp_sizes)
+            ct_estimate += (unsigned long) chips.nchip * (width / size_class) * (height / size_class);
+        std::cout<<"Superpixels to be scanned: ~"<<ct_estimate<<" in "<<chips.nchip<<" chips"<<std::endl;
+        int next_progress = 1;
+
+        // Per model: chips overlap, so with --fcn their conv features are computed once for the whole frame,
+        // on the first chip that misses the feature cache
+        const size_t num_dcnns = dcnns.size();
+        std::vector<std::unique_ptr<spt::dnn::TiledFeatureMap>> frame_features(num_dcnns);
+        std::vector<std::unique_ptr<spt::dnn::SuperpixelPooling>> frame_pooling(num_dcnns);
+        std::vector<float> pooled_features;
+        std::vector<int> nsp_model(num_dcnns);
+        cv::Mat frame_rgb;
+        for(size_t m = 0; m<num_dcnns; ++m) {
+            const FullyConvolutional *fcn = dcnns[m].fcn;
+            nsp_model[m] = fcn ? (int) fcn->nsp : dcnns[m].inference->GetNSP();
+            if (fcn) frame_pooling[m] = std::make_unique<spt::dnn::SuperpixelPooling>(fcn->pooling_modes);
         }
-        std::cout<<"Superpixels to be scanned: "<<ct_superpixel<<std::endl;
 
-        pqxx::connection conn2("dbname=xview user=postgres");
-        pqxx::work w_spstream(conn2);
-        pqxx::stream_to sps {
-                w_spstream, "superpixel_inference",
+        // --feature-cache, --segmentation-cache: chips are keyed by the image's content, so renamed or re-ingested images still hit
+        const uint64_t image_hash = feature_cache || segmentation_cache ? os_misc::HashFile(fname.c_str()) : 0;
+        auto cache_key = [&](size_t m, const cv::Rect &chip, int size_class) {
+            std::stringstream key;
+            key<<std::hex<<image_hash<<std::dec<<'|'<<chip.x<<','<<chip.y<<','<<chip.width<<','<<chip.height
+               <<'|'<<sp_backend<<'|'<<size_class<<"|5|"<<dcnns[m].signature;
+            return key.str();
+        };
+        std::vector<unsigned long> cache_hits(num_dcnns, 0);
+
+        // Rows go out in binary COPY, features straight from their blocks
+        spt::pgsaver::BinaryCopyWriter sps {
+                "dbname=xview user=postgres", "superpixel_inference",
                 std::vector<std::string> {
                         "frame_id",
                         "size_class",
@@ -107,83 +170,316 @@ order by st_area(bbox.xview_bounds_imcoords);");
         };
 
         int rows_inserted = 0;
-        for(int chip_id = 0; chip_id<chips.nchip; ++chip_id) {
-            roi = chips.GetROI(chip_id);
+        // Keep a batch worth of chips in flight; the inference services batch them with other workers' chips
+        int batch_size = 1;
+        for(auto const &dcnn: dcnns)
+            if (dcnn.inference) batch_size = std::max(batch_size, dcnn.inference->GetMaxBatchSize());
+        // Per label map l = b * num_sizes + j: chip b segmented at size class j
+        const int max_label_maps = batch_size * num_sizes;
+        std::vector<cv::Mat> batch_frames, batch_labels, chip_labels;
+        std::vector<std::shared_ptr<const spt::SegmentationResult>> batch_segmentations;
+        // batch_features[m][b]: one block per size class of model m for chip b
+        std::vector<std::vector<std::future<std::vector<spt::dnn::FeatureBlock>>>> batch_features(num_dcnns);
+        std::vector<std::vector<std::vector<spt::dnn::FeatureBlock>>> batch_blocks(num_dcnns);
+        // batch_cached[m][b]: the blocks came from the feature cache and need not be stored again
+        std::vector<std::vector<char>> batch_cached(num_dcnns);
+        std::vector<spt::SuperpixelIndex> batch_indices(max_label_maps);
+        // Superpixels present in each label map in ascending order; model m gets the prefix below its NSP
+        std::vector<std::vector<int>> batch_ids(max_label_maps), chip_ids;
+        std::vector<std::vector<size_t>> batch_rows(num_dcnns, std::vector<size_t>(max_label_maps));
+        std::vector<unsigned long> superpixels_dropped(num_dcnns, 0);
+        // Segmentation of the next chip runs in the background while this one goes through DCNN and the DB.
+        // Label maps found in the segmentation cache come back as ready futures; misses are stored once computed.
+        std::vector<std::string> segmentation_settings;
+        for(const int size_class: sp_sizes)
+            segmentation_settings.push_back(spt::SegmentationSettings(sp_backend, {.size = {width, height}, .superpixel_size = size_class, .num_iter = 5}));
+        std::vector<char> next_cached(num_sizes, 0);
+        auto segment = [&](int j, int chip_id) {
+            const cv::Rect chip = chips.GetROI(chip_id);
+            next_cached[j] = 0;
+            if (segmentation_cache) {
+                auto cached = std::make_shared<spt::SegmentationResult>();
+                if (segmentation_cache->Load(spt::SegmentationCache::Key(image_hash, chip, segmentation_settings[j]), *cached)) {
+                    std::promise<std::shared_ptr<const spt::SegmentationResult>> ready;
+                    ready.set_value(std::move(cached));
+                    next_cached[j] = 1;
+                    return ready.get_future();
+                }
+            }
+            return _superpixels[j]->ComputeAsync(frame_raw(chip));
+        };
+        std::vector<std::future<std::shared_ptr<const spt::SegmentationResult>>> next_segmentation(num_sizes);
+        for(int j = 0; j<num_sizes; ++j)
+            next_segmentation[j] = segment(j, 0);
+        for(int batch_start = 0; batch_start<chips.nchip; batch_start += batch_size) {
+            const int n = std::min(batch_size, chips.nchip - batch_start);
+            batch_frames.resize(n);
+            batch_labels.resize(n * num_sizes);
+            batch_segmentations.resize(n * num_sizes);
+            for(size_t m = 0; m<num_dcnns; ++m) {
+                batch_features[m].resize(n);
+                batch_blocks[m].resize(n);
+                batch_cached[m].assign(n, 0);
+            }
+            for(int b = 0; b<n; ++b) {
+                const int chip_id = batch_start + b;
+                batch_frames[b].release();
+                for(int j = 0; j<num_sizes; ++j) {
+                    const int l = b * num_sizes + j;
+                    // holding the result keeps its label buffer from being recycled until this batch is done
+                    batch_segmentations[l] = next_segmentation[j].get();
+                    if (segmentation_cache && !next_cached[j])
+                        segmentation_cache->Store(spt::SegmentationCache::Key(image_hash, chips.GetROI(chip_id), segmentation_settings[j]),
+                                                  batch_segmentations[l]->labels, batch_segmentations[l]->num_superpixels);
+                    if (chip_id + 1 < chips.nchip)
+                        next_segmentation[j] = segment(j, chip_id + 1);
+                    batch_labels[l] = batch_segmentations[l]->labels;
+                    ct_superpixel += batch_segmentations[l]->num_superpixels;
 
-            frame = frame_raw(roi);
-            cv::cvtColor(frame, frame_dcnn, cv::COLOR_BGR2RGB);
+                    // Only features of superpixels that exist are fetched; labels past a model's capacity have none
+                    batch_indices[l].Compute(batch_labels[l]);
+                    batch_ids[l].clear();
+                    for(unsigned int s = 0; s<batch_indices[l].GetNumSuperpixels(); ++s) {
+                        if (batch_indices[l].GetArea(s) == 0) continue;
+                        batch_ids[l].push_back(s);
+                    }
+                }
+                chip_labels.assign(batch_labels.begin() + b * num_sizes, batch_labels.begin() + (b + 1) * num_sizes);
 
-            spt::ISuperpixel *superpixel = _superpixel.Compute(frame);
-            unsigned int nsp = superpixel->GetNumSuperpixels();
-            superpixel->GetLabels(superpixel_labels);
+                for(size_t m = 0; m<num_dcnns; ++m) {
+                    chip_ids.resize(num_sizes);
+                    for(int j = 0; j<num_sizes; ++j) {
+                        const int l = b * num_sizes + j;
+                        const std::vector<int> &present = batch_ids[l];
+                        const size_t rows = std::lower_bound(present.begin(), present.end(), nsp_model[m]) - present.begin();
+                        batch_rows[m][l] = rows;
+                        superpixels_dropped[m] += present.size() - rows;
+                        chip_ids[j].assign(present.begin(), present.begin() + rows);
+                    }
+                    if (feature_cache) {
+                        // a hit needs every size class, each a whole number of rows
+                        std::vector<spt::dnn::FeatureBlock> blocks(num_sizes);
+                        bool hit = true;
+                        for(int j = 0; j<num_sizes && hit; ++j) {
+                            const void *data;
+                            size_t size;
+                            const size_t rows = chip_ids[j].size();
+                            hit = feature_cache->Find(cache_key(m, chips.GetROI(chip_id), sp_sizes[j]), data, size) &&
+                                  size % sizeof(float) == 0 && (rows == 0 ? size == 0 : size / sizeof(float) % rows == 0);
+                            if (hit) blocks[j].assign(static_cast<const float *>(data), static_cast<const float *>(data) + size / sizeof(float));
+                        }
+                        if (hit) {
+                            std::promise<std::vector<spt::dnn::FeatureBlock>> ready;
+                            ready.set_value(std::move(blocks));
+                            batch_features[m][b] = ready.get_future();
+                            batch_cached[m][b] = 1;
+                            ++cache_hits[m];
+                            continue;
+                        }
+                    }
+                    const FullyConvolutional *fcn = dcnns[m].fcn;
+                    if (fcn && !frame_features[m]) {
+                        if (frame_rgb.empty())
+                            cv::cvtColor(frame_raw, frame_rgb, cv::COLOR_BGR2RGB);
+                        frame_features[m] = std::make_unique<spt::dnn::TiledFeatureMap>(fcn->trunk, fcn->tile_size, fcn->halo, fcn->trunk_mutex);
+                        if (!frame_features[m]->Compute(frame_rgb)) {
+                            std::cerr<<"Failed to compute the frame's feature map for "<<dcnns[m].dcnn_name<<"."<<std::endl;
+                            return;
+                        }
+                    }
+                    if (fcn) {
+                        const spt::dnn::FeatureMap features = frame_features[m]->GetFeatureMap();
+                        const int dim = frame_pooling[m]->GetFeatureDim(features.channels);
+                        pooled_features.resize((size_t) fcn->nsp * dim);
+                        std::vector<spt::dnn::FeatureBlock> blocks(num_sizes);
+                        for(int j = 0; j<num_sizes; ++j) {
+                            frame_pooling[m]->Compute(features, chip_labels[j], chips.GetROI(chip_id).tl(), frame_features[m]->GetStride(),
+                                                      fcn->nsp, pooled_features.data());
+                            blocks[j].resize(chip_ids[j].size() * dim);
+                            for(size_t k = 0; k<chip_ids[j].size(); ++k)
+                                std::copy_n(pooled_features.begin() + (size_t) chip_ids[j][k] * dim, dim, blocks[j].begin() + k * dim);
+                        }
+                        std::promise<std::vector<spt::dnn::FeatureBlock>> ready;
+                        ready.set_value(std::move(blocks));
+                        batch_features[m][b] = ready.get_future();
+                    }
+                    else {
+                        // decoded to RGB once per chip, shared by every model and size class
+                        if (batch_frames[b].empty())
+                            cv::cvtColor(frame_raw(chips.GetROI(chip_id)), batch_frames[b], cv::COLOR_BGR2RGB);
+                        batch_features[m][b] = dcnns[m].inference->Submit(batch_frames[b], chip_labels, chip_ids);
+                    }
+                }
+            }
 
-            #pragma omp critical(DCNNInference)
-            {
-                dcnn->Compute(frame_dcnn, superpixel_labels);
-                dcnn->GetFeature(superpixel_feature_buffer.data());
-                // TODO Output gSLIC nsp somewhere std::cout<<"nsp "<<nsp<<std::endl;
+            // Progress in tenths of the chips
+            if ((batch_start + n) * 10 >= next_progress * chips.nchip) {
+                std::stringstream ss;
+                ss<<fname<<": "<<batch_start + n<<"/"<<chips.nchip<<" chips, "<<ct_superpixel<<" superpixels"<<std::endl;
+                std::cout<<ss.str();
+                next_progress = (batch_start + n) * 10 / chips.nchip + 1;
             }
 
-            for(unsigned int s = 0; s<nsp; ++s) {
-                superpixel_selected = superpixel_labels == s;
-                cv::findContours(superpixel_selected, superpixel_sel_contour, cv::RETR_TREE, cv::CHAIN_APPROX_SIMPLE);
-
-                superpixel_moments = cv::moments(superpixel_sel_contour[0], true);
-                const auto area = static_cast<float>(superpixel_moments.m00);
-                if (area > 0) {
-                    const auto cxf32 = static_cast<float>(superpixel_moments.m10/area+roi.x), cyf32 = static_cast<float>(superpixel_moments.m01/area+roi.y);
-                    pqxx::work w_bbox(conn);
-                    r = w_bbox.exec_prepared("sql_match_bbox2", image, (int)cxf32, (int)cyf32);
-                    w_bbox.commit();
-                    int class_label_multiplicity = r.size();
-                    if(r.size() > 0) {
-                        spt::pgsaver::vec2str(
-                                superpixel_feature_buffer,
-                                (s*dcnn->GetFeatureDim()),
-                                dcnn->GetFeatureDim(),
-                                superpixel_feature_strbuffer);
-
-                        sps<<std::make_tuple(
-                                frame_id, size_class,
-                                area, (int)cxf32, (int)cyf32,
-                                dcnn_name, superpixel_feature_strbuffer,
-                                r[0]["xview_type_id"].as<int>(), class_label_multiplicity);
-                        ++rows_inserted;
-                        if (verbose) {
-                            std::cout << "<frame_id = " << frame_id << ", chip = " << roi << ", s = " << s << ">"
-                                      << std::endl;
-                            std::cout << "  Area = " << area << std::endl;
-                            std::cout << "  Centroid = " << cxf32 << "," << cyf32 << std::endl;
-                            std::cout << "  Objects = " << class_label_multiplicity << std::endl;
-                            std::cout << "    ";
-                            for (auto const &row: r) {
-                                std::cout << row["label_name"] << ". ";
+            for(int b = 0; b<n; ++b) {
+                roi = chips.GetROI(batch_start + b);
+                for(size_t m = 0; m<num_dcnns; ++m) {
+                    batch_blocks[m][b] = batch_features[m][b].get();
+                    if (!feature_cache || batch_cached[m][b]) continue;
+                    for(int j = 0; j<num_sizes; ++j) {
+                        const spt::dnn::FeatureBlock &block = batch_blocks[m][b][j];
+                        feature_cache->Append(cache_key(m, roi, sp_sizes[j]), block.data(), block.size() * sizeof(float));
+                    }
+                }
+                for(int j = 0; j<num_sizes; ++j) {
+                    const int l = b * num_sizes + j, size_class = sp_sizes[j];
+                    const spt::SuperpixelIndex &superpixel_index = batch_indices[l];
+                    size_t max_rows = 0;
+                    std::vector<int> feature_dim(num_dcnns);
+                    for(size_t m = 0; m<num_dcnns; ++m) {
+                        max_rows = std::max(max_rows, batch_rows[m][l]);
+                        feature_dim[m] = batch_rows[m][l] == 0 ? 0 :
+                                static_cast<int>(batch_blocks[m][b][j].size() / batch_rows[m][l]);
+                    }
+
+                    // Geometry and the bbox lookup are shared by the rows every model writes for a superpixel
+                    for(size_t k = 0; k<max_rows; ++k) {
+                        const int s = batch_ids[l][k];
+                        superpixel_index.GetMask(s, superpixel_selected, superpixel_roi);
+                        cv::findContours(superpixel_selected, superpixel_sel_contour, cv::RETR_TREE, cv::CHAIN_APPROX_SIMPLE, superpixel_roi.tl());
+
+                        superpixel_moments = cv::moments(superpixel_sel_contour[0], true);
+                        const auto area = static_cast<float>(superpixel_moments.m00);
+                        if (area > 0) {
+                            const auto cxf32 = static_cast<float>(superpixel_moments.m10/area+roi.x), cyf32 = static_cast<float>(superpixel_moments.m01/area+roi.y);
+                            bbox_index.Match((int)cxf32, (int)cyf32, bbox_matches);
+                            int class_label_multiplicity = bbox_matches.size();
+                            if(!bbox_matches.empty()) {
+                                for(size_t m = 0; m<num_dcnns; ++m) {
+                                    if (k >= batch_rows[m][l]) continue;
+                                    const float *feature = batch_blocks[m][b][j].data() + k*feature_dim[m];
+                                    sps.WriteRow(
+                                            frame_id, size_class,
+                                            area, (int)cxf32, (int)cyf32,
+                                            dcnns[m].dcnn_name, spt::pgsaver::array_ref(feature, feature_dim[m]),
+                                            bbox_index.GetBBox(bbox_matches[0]).xview_type_id, class_label_multiplicity);
+                                    ++rows_inserted;
+                                }
+                                if (verbose) {
+                                    std::cout << "<frame_id = " << frame_id << ", chip = " << roi << ", size = " << size_class << ", s = " << s << ">"
+                                              << std::endl;
+                                    std::cout << "  Area = " << area << std::endl;
+                                    std::cout << "  Centroid = " << cxf32 << "," << cyf32 << std::endl;
+                                    std::cout << "  Objects = " << class_label_multiplicity << std::endl;
+                                    std::cout << "    ";
+                                    for (const int i: bbox_matches) {
+                                        std::cout << bbox_index.GetBBox(i).label_name << ". ";
+                                    }
+                                    std::cout << std::endl;
+                                }
                             }
-                            std::cout << std::endl;
                         }
+
                     }
                 }
-
             }
         }
         sps.complete();
-        w_spstream.commit();
-        std::cerr<<"Done. +"<<rows_inserted<<" rows"<<std::endl;
+        std::cerr<<"Done. +"<<rows_inserted<<" rows from "<<ct_superpixel<<" superpixels"<<std::endl;
+        for(size_t m = 0; m<num_dcnns; ++m) {
+            if (feature_cache)
+                std::cerr<<dcnns[m].dcnn_name<<": "<<cache_hits[m]<<" of "<<chips.nchip<<" chips from the feature cache"<<std::endl;
+            if (superpixels_dropped[m] > 0)
+                std::cerr<<"WARNING "<<superpixels_dropped[m]<<" superpixels exceeded "<<dcnns[m].dcnn_name<<"'s "<<nsp_model[m]<<" and were skipped"<<std::endl;
+        }
     }
     catch (const std::exception &e) {
         std::cerr<<e.what()<<std::endl;
     }
 }
 
+/// --validate: run the fp32 reference and a reduced-precision model on one chip of an image, compare their features
+bool validate_precision(spt::dnn::IComputeFrameSuperpixel &reference, spt::dnn::IComputeFrameSuperpixel &variant,
+                        const std::string &fname, const std::string &sp_backend, const int sp_size, const int chip_size,
+                        const double min_cosine) {
+    cv::Mat frame = cv::imread(fname, cv::IMREAD_COLOR);
+    if(frame.empty()) {
+        std::cerr<<"Cannot read "<<fname<<" for validation."<<std::endl;
+        return false;
+    }
+    frame = frame(cv::Rect(0, 0, std::min(chip_size, frame.cols), std::min(chip_size, frame.rows))).clone();
+    auto superpixel = spt::SuperpixelRegistry::Instance().Create(
+            sp_backend, {.size = frame.size(), .superpixel_size = sp_size, .num_iter = 5});
+    cv::Mat labels, frame_rgb;
+    superpixel->Compute(frame)->GetLabels(labels);
+    // segmented in BGR and fed to the DCNNs in RGB, like the chips of process_tif
+    cv::cvtColor(frame, frame_rgb, cv::COLOR_BGR2RGB);
+    if(!reference.Compute(frame_rgb, labels) || !variant.Compute(frame_rgb, labels)) {
+        std::cerr<<"Validation inference failed."<<std::endl;
+        return false;
+    }
+    const int dim = reference.GetFeatureDim();
+    if(variant.GetFeatureDim() != dim) {
+        std::cerr<<"Feature dimensions differ: "<<dim<<" (fp32) vs "<<variant.GetFeatureDim()<<"."<<std::endl;
+        return false;
+    }
+    std::vector<int> ids(std::min({(int) superpixel->GetNumSuperpixels(), reference.GetNSP(), variant.GetNSP()}));
+    std::iota(ids.begin(), ids.end(), 0);
+    std::vector<float> reference_features(ids.size() * dim), variant_features(ids.size() * dim);
+    reference.GetFeatures(ids, reference_features.data());
+    variant.GetFeatures(ids, variant_features.data());
+    const spt::dnn::FeatureDrift drift = spt::dnn::ComputeFeatureDrift(
+            reference_features.data(), variant_features.data(), ids.size(), dim);
+    drift.Print(std::cerr);
+    if(drift.min_cosine < min_cosine) {
+        std::cerr<<"Cosine similarity fell below "<<min_cosine<<"."<<std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// A DCNN given to -n: its model replicas and the service batching chips to them.
+/// Members are destroyed bottom-up, so the service stops before the models and the models before their sessions.
+struct DCNNInstance {
+    std::string name, signature;
+    std::shared_ptr<spt::dnn::Profiler> profiler;
+#ifdef HAS_TF
+    std::unique_ptr<spt::dnn::VGG16SP> graph;
+    std::unique_ptr<spt::dnn::SessionPool> sessions;
+#endif
+    std::vector<std::unique_ptr<spt::dnn::IComputeFrameSuperpixel>> models;
+    std::unique_ptr<spt::dnn::InferenceService> inference;
+    std::vector<spt::dnn::IComputeFeatureMap *> trunks;
+    std::vector<std::mutex> trunk_mutexes;
+};
+
 int main(int argc, char* argv[]) {
     ///////////////////////////
     // Argument Parser
     ///////////////////////////
     ArgumentParser parser("Superpixel Feature Inference Pipeline");
-    parser.add_argument("-n", "DCNN name", true);
+    parser.add_argument("-n", "DCNN name[=graph] [name[=graph] ...], all fed from one segmentation pass", true);
     parser.add_argument("-d", "Dataset location", true);
     parser.add_argument("-c", "Chipping Overlap (=0.5)");
-    parser.add_argument("-s", "Superpixel Size (=32)");
+    parser.add_argument("--chip", "Chip Size (=256)");
+    parser.add_argument("-s", "Superpixel Size(s) (=32)");
+    parser.add_argument("-b", "Superpixel Backend (=gslic)");
+    parser.add_argument("--batch", "DCNN Batch Size (=1)");
+    parser.add_argument("--max-wait", "Max Wait in ms for a DCNN Batch to Fill (=5)");
+    parser.add_argument("--sessions", "Number of TensorFlow Sessions / OpenCV Networks (=1)");
+    parser.add_argument("--intra-op", "Intra-op Threads per Session (=0, TensorFlow default)");
+    parser.add_argument("--inter-op", "Inter-op Threads per Session (=0, TensorFlow default)");
+    parser.add_argument("--pool", "Pool block5_pool per Superpixel in C++: avg, max or avgmax (=in-graph)");
+    parser.add_argument("--dnn", "DCNN Backend: tf or opencv (=tf when built with TensorFlow)");
+    parser.add_argument("--dnn-model", "ONNX or Frozen Graph for the opencv Backend (=vgg16.onnx)");
+    parser.add_argument("--layers", "Comma-separated Layers Pooled from one Forward Pass and Concatenated per Superpixel (=block5_pool)");
+    parser.add_argument("--fcn", "Run the DCNN trunk once per frame in tiles of this size and pool chips from it; one Layer at most (=off)");
+    parser.add_argument("--fcn-halo", "Receptive-field halo around each --fcn tile in pixels (=128)");
+    parser.add_argument("--precision", "DCNN Precision: fp32, fp16 or int8, loading the Model's .fp16/.int8 Variant (=fp32)");
+    parser.add_argument("--validate", "Compare --precision Features against fp32 on one Chip of this Image before Processing");
+    parser.add_argument("--min-cosine", "Least per-Superpixel Cosine Similarity --validate Accepts (=0.99)");
+    parser.add_argument("--feature-cache", "Reuse DCNN Features across Runs from this Record File, keyed by Image Content, Chip, Segmentation and Model (=off)");
+    parser.add_argument("--segmentation-cache", "Reuse Label Maps across Runs and Tools from this Record File, keyed by Image Content, Chip and Segmentation Settings (=off)");
+    parser.add_argument("--profile", "Time DCNN Stages, Ops and Layers; Print them at Exit and Write a Chrome Trace to the optional Path (=off)");
     try {
         parser.parse(argc, argv);
     } catch (const ArgumentParser::ArgumentNotFound& ex) {
@@ -202,27 +498,204 @@ int main(int argc, char* argv[]) {
     // Chipping
     ///////////////////////////
     const float chip_overlap = parser.exists("c") ? parser.get<float>("c") : 0.5;
+    const int chip_size = parser.exists("chip") ? parser.get<int>("chip") : 256;
 
     ///////////////////////////
     // Superpixel
     ///////////////////////////
-    const int sp_size = parser.exists("s") ? parser.get<int>("s") : 32;
+    // several size classes share one DCNN trunk pass per chip
+    const std::vector<int> sp_sizes = parser.exists("s") ? parser.getv<int>("s") : std::vector<int>{32};
+#ifdef HAS_LIBGSLIC
+    const std::string sp_backend = parser.exists("b") ? parser.get<std::string>("b") : "gslic";
+#else
+    const std::string sp_backend = parser.exists("b") ? parser.get<std::string>("b") : "gslic-cpu";
+#endif
+    if(!spt::SuperpixelRegistry::Instance().Has(sp_backend)) {
+        std::cerr<<"Unknown superpixel backend "<<sp_backend<<". Available:";
+        for(auto const &name: spt::SuperpixelRegistry::Instance().Names())
+            std::cerr<<" "<<name;
+        std::cerr<<std::endl;
+        return 1;
+    }
 
     ///////////////////////////
     // DCNN Inference (shared across omp threads)
     ///////////////////////////
-    const std::string dcnn_name = parser.get<std::string>("n");
-    spt::dnn::VGG16SP dcnn;
-    dcnn.Summary();
-    tf::SessionOptions options;
-    options.config.mutable_gpu_options()->set_per_process_gpu_memory_fraction(0.45);
-    if(dcnn.NewSession(options)) {
-        std::cerr<<"Successfully initialized a new TensorFlow session."<<std::endl;
+    const int batch_size = parser.exists("batch") ? parser.get<int>("batch") : 1;
+    if(batch_size < 1) {
+        std::cerr<<"--batch must be at least 1."<<std::endl;
+        return 1;
     }
-    else {
-        std::cerr<<"Failed to initialized a new TensorFlow session."<<std::endl;
+    int pooling_modes = 0;
+    if(parser.exists("pool")) {
+        const std::string pool = parser.get<std::string>("pool");
+        if(pool == "avg") pooling_modes = spt::dnn::SuperpixelPooling::Average;
+        else if(pool == "max") pooling_modes = spt::dnn::SuperpixelPooling::Max;
+        else if(pool == "avgmax") pooling_modes = spt::dnn::SuperpixelPooling::Average | spt::dnn::SuperpixelPooling::Max;
+        else {
+            std::cerr<<"Unknown pooling "<<pool<<". Available: avg max avgmax"<<std::endl;
+            return 1;
+        }
+    }
+    std::vector<std::string> layers;
+    if(parser.exists("layers")) {
+        std::stringstream ss(parser.get<std::string>("layers"));
+        for(std::string layer; std::getline(ss, layer, ',');)
+            if(!layer.empty()) layers.push_back(layer);
+    }
+    // the tiled trunk, extra layers and shared trunk passes for several size classes are pooled in C++
+    if((parser.exists("fcn") || !layers.empty() || sp_sizes.size() > 1) && !pooling_modes)
+        pooling_modes = spt::dnn::SuperpixelPooling::Average;
+    const int num_sessions = parser.exists("sessions") ? parser.get<int>("sessions") : 1;
+#ifdef HAS_TF
+    const std::string dnn_backend = parser.exists("dnn") ? parser.get<std::string>("dnn") : "tf";
+#else
+    const std::string dnn_backend = parser.exists("dnn") ? parser.get<std::string>("dnn") : "opencv";
+#endif
+    const int max_wait = parser.exists("max-wait") ? parser.get<int>("max-wait") : 5;
+    const bool fully_convolutional = parser.exists("fcn");
+    const int fcn_tile = fully_convolutional ? parser.get<int>("fcn") : 0;
+    const int fcn_halo = parser.exists("fcn-halo") ? parser.get<int>("fcn-halo") : 128;
+    // the tiled trunk computes one feature map, the first output layer's
+    if(fully_convolutional && layers.size() > 1) {
+        std::cerr<<"--fcn pools a single layer; pass at most one to --layers."<<std::endl;
+        return 1;
+    }
+    spt::dnn::Precision precision = spt::dnn::Precision::FP32;
+    if(parser.exists("precision") && !spt::dnn::ParsePrecision(parser.get<std::string>("precision"), precision)) {
+        std::cerr<<"Unknown precision "<<parser.get<std::string>("precision")<<". Available: fp32 fp16 int8"<<std::endl;
+        return 1;
+    }
+    if(parser.exists("validate") && precision == spt::dnn::Precision::FP32) {
+        std::cerr<<"--validate compares a reduced --precision against fp32; pass --precision fp16 or int8."<<std::endl;
+        return 1;
+    }
+    const double min_cosine = parser.exists("min-cosine") ? parser.get<double>("min-cosine") : 0.99;
+    os_misc::RecordStore feature_cache;
+    if(parser.exists("feature-cache")) {
+        if(!feature_cache.Open(parser.get<std::string>("feature-cache"))) return 1;
+        std::cerr<<feature_cache.size()<<" feature blocks in the cache"<<std::endl;
+    }
+    spt::SegmentationCache segmentation_cache;
+    if(parser.exists("segmentation-cache")) {
+        if(!segmentation_cache.Open(parser.get<std::string>("segmentation-cache"))) return 1;
+        std::cerr<<segmentation_cache.size()<<" label maps in the segmentation cache"<<std::endl;
+    }
+    // tracing slows every run down, so profiles are for finding hot spots rather than measuring throughput
+    const bool profile = parser.exists("profile");
+    const std::vector<std::string> profile_trace = profile ? parser.getv<std::string>("profile") : std::vector<std::string>();
+
+    // Every -n name[=graph] consumes the same chips and label maps; decode and segmentation are paid once
+    const std::vector<std::string> dcnn_specs = parser.getv<std::string>("n");
+    std::vector<std::unique_ptr<DCNNInstance>> dcnns;
+    for(auto const &spec: dcnn_specs) {
+        auto dcnn = std::make_unique<DCNNInstance>();
+        const size_t eq = spec.find('=');
+        dcnn->name = spec.substr(0, eq);
+        if(profile) dcnn->profiler = std::make_shared<spt::dnn::Profiler>();
+        const std::string graph_path = eq == std::string::npos ? "" : spec.substr(eq + 1);
+        {
+            std::stringstream signature;
+            signature<<dcnn->name<<'|'<<dnn_backend<<'|'<<graph_path<<'|'<<(parser.exists("dnn-model") ? parser.get<std::string>("dnn-model") : "")
+                     <<'|'<<spt::dnn::PrecisionName(precision)<<'|'<<pooling_modes<<'|'<<(parser.exists("layers") ? parser.get<std::string>("layers") : "")
+                     <<'|'<<fcn_tile<<','<<fcn_halo;
+            dcnn->signature = signature.str();
+        }
+        // fp32 reference for --validate, built the same way as the models
+        std::unique_ptr<spt::dnn::IComputeFrameSuperpixel> reference;
+#ifdef HAS_TF
+        if(dnn_backend == "tf") {
+            const std::string base_graph = graph_path.empty() ? MODEL_WEIGHTS "vgg16sp.frozen.pb" : graph_path;
+            dcnn->graph = std::make_unique<spt::dnn::VGG16SP>(spt::dnn::ModelVariant(base_graph, precision));
+            dcnn->graph->Summary();
+            // Sessions share the loaded graph; the GPU memory budget is split between all models' sessions
+            spt::dnn::SessionPool::Options pool_options;
+            pool_options.num_sessions = num_sessions;
+            pool_options.intra_op_threads = parser.exists("intra-op") ? parser.get<int>("intra-op") : 0;
+            pool_options.inter_op_threads = parser.exists("inter-op") ? parser.get<int>("inter-op") : 0;
+            pool_options.gpu_memory_fraction = 0.45 / std::max(pool_options.num_sessions * (int) dcnn_specs.size(), 1);
+            dcnn->sessions = std::make_unique<spt::dnn::SessionPool>(dcnn->graph->graph, pool_options);
+            if(dcnn->sessions->size() > 0) {
+                std::cerr<<"Successfully initialized "<<dcnn->sessions->size()<<" TensorFlow session(s) for "<<dcnn->name<<"."<<std::endl;
+            }
+            else {
+                std::cerr<<"Failed to initialized a new TensorFlow session."<<std::endl;
+                return 1;
+            }
+            for(size_t i = 0; i<dcnn->sessions->size(); ++i) {
+                auto model = std::make_unique<spt::dnn::VGG16SP>((*dcnn->sessions)[i]);
+                // before the callables are made, so that they trace
+                model->SetProfiler(dcnn->profiler);
+                model->SetInputResolution(256, 256, batch_size);
+                if(!layers.empty())
+                    model->SetPooling(layers, pooling_modes);
+                else if(pooling_modes)
+                    model->SetPooling("DCNN/block5_pool/MaxPool:0", pooling_modes);
+                dcnn->models.push_back(std::move(model));
+            }
+            if(parser.exists("validate")) {
+                auto model = std::make_unique<spt::dnn::VGG16SP>(base_graph);
+                if(!model->NewSession()) return 1;
+                model->SetInputResolution(256, 256, 1);
+                if(!layers.empty())
+                    model->SetPooling(layers, pooling_modes);
+                else if(pooling_modes)
+                    model->SetPooling("DCNN/block5_pool/MaxPool:0", pooling_modes);
+                reference = std::move(model);
+            }
+        }
+#endif
+        if(dnn_backend == "opencv") {
+            // cv::dnn has its own thread pool; --sessions sets the number of network replicas
+            const std::string dnn_model = !graph_path.empty() ? graph_path :
+                                          parser.exists("dnn-model") ? parser.get<std::string>("dnn-model") : "";
+            const int modes = pooling_modes ? pooling_modes : spt::dnn::SuperpixelPooling::Average;
+            for(int i = 0; i<std::max(num_sessions, 1); ++i) {
+                auto model = std::make_unique<spt::dnn::OpenCVVGG16SP>(dnn_model, "", modes, 1024, precision);
+                if(!model->Loaded()) return 1;
+                model->SetProfiler(dcnn->profiler);
+                if(!layers.empty())
+                    model->SetOutputLayers(layers);
+                model->SetInputResolution(256, 256, batch_size);
+                dcnn->models.push_back(std::move(model));
+            }
+            if(parser.exists("validate")) {
+                auto model = std::make_unique<spt::dnn::OpenCVVGG16SP>(dnn_model, "", modes);
+                if(!model->Loaded()) return 1;
+                if(!layers.empty())
+                    model->SetOutputLayers(layers);
+                model->SetInputResolution(256, 256, 1);
+                reference = std::move(model);
+            }
+        }
+        if(dcnn->models.empty()) {
+            std::cerr<<"Unknown DCNN backend "<<dnn_backend<<"."<<std::endl;
+            return 1;
+        }
+        if(reference) {
+            std::cerr<<"Validating "<<dcnn->name<<" ("<<spt::dnn::PrecisionName(precision)<<") against fp32"<<std::endl;
+            if(!validate_precision(*reference, *dcnn->models[0], parser.get<std::string>("validate"),
+                                   sp_backend, sp_sizes[0], chip_size, min_cosine))
+                return 1;
+        }
+        std::vector<spt::dnn::IComputeFrameSuperpixel *> executors;
+        for(auto const &model: dcnn->models)
+            executors.push_back(model.get());
+        // One executor per session; workers queue chips to them instead of taking turns on a lock
+        dcnn->inference = std::make_unique<spt::dnn::InferenceService>(executors, batch_size, std::chrono::milliseconds(max_wait));
+
+        // Fully convolutional mode: workers take turns on the model replicas for their frames' tiles
+        for(auto const &model: dcnn->models) {
+            auto trunk = dynamic_cast<spt::dnn::IComputeFeatureMap *>(model.get());
+            if(trunk) dcnn->trunks.push_back(trunk);
+        }
+        dcnn->trunk_mutexes = std::vector<std::mutex>(dcnn->trunks.size());
+        if(fully_convolutional && dcnn->trunks.empty()) {
+            std::cerr<<"The "<<dnn_backend<<" backend cannot compute feature maps for --fcn."<<std::endl;
+            return 1;
+        }
+        dcnns.push_back(std::move(dcnn));
     }
-    dcnn.SetInputResolution(256, 256);
 
     ///////////////////////////
     // Parallel image directory scanning
@@ -230,26 +703,58 @@ int main(int argc, char* argv[]) {
     // Limit number of threads because each thread is holding expensive resources
     size_t nproc_omp = std::min(omp_get_max_threads(), 16);
     os_misc::Glob train_images((dataset / "train_images/*.tif").string().c_str());
-    #pragma omp parallel for num_threads(nproc_omp) default(none) shared(dataset, train_images, dcnn_name, dcnn)
+    #pragma omp parallel for num_threads(nproc_omp) default(none) shared(dataset, train_images, sp_backend, sp_sizes, dcnns, pooling_modes, feature_cache, segmentation_cache)
     for (size_t i = 0; i < train_images.size(); ++i) {
         int tid = omp_get_thread_num();
         std::string fname(train_images[i]);
         std::stringstream ss;
         ss << "tid=" << tid << " Processing " << fname << std::endl;
         std::cout << ss.str(); // std::cout is thread-safe
-        process_tif(dataset, fname, &dcnn, chip_overlap, dcnn_name, sp_size);
+        std::vector<FullyConvolutional> fcn(dcnns.size());
+        std::vector<DCNNRun> runs(dcnns.size());
+        for (size_t m = 0; m < dcnns.size(); ++m) {
+            DCNNInstance &dcnn = *dcnns[m];
+            runs[m].dcnn_name = dcnn.name;
+            runs[m].signature = dcnn.signature;
+            runs[m].inference = dcnn.inference.get();
+            if (fully_convolutional) {
+                fcn[m].trunk = dcnn.trunks[tid % dcnn.trunks.size()];
+                fcn[m].trunk_mutex = &dcnn.trunk_mutexes[tid % dcnn.trunks.size()];
+                fcn[m].tile_size = fcn_tile;
+                fcn[m].halo = fcn_halo;
+                fcn[m].pooling_modes = pooling_modes;
+                fcn[m].nsp = dcnn.inference->GetNSP();
+                runs[m].fcn = &fcn[m];
+            }
+        }
+        process_tif(dataset, fname, runs, chip_overlap, sp_backend, sp_sizes, chip_size,
+                    feature_cache.IsOpen() ? &feature_cache : nullptr,
+                    segmentation_cache.IsOpen() ? &segmentation_cache : nullptr);
     }
 
 // val_images did not match any metadata
 //    os_misc::Glob val_images((dataset / "val_images/*.tif").string().c_str());
-//    #pragma omp parallel for num_threads(nproc_omp) default(none) shared(dataset, val_images, dcnn_name, dcnn)
+//    #pragma omp parallel for num_threads(nproc_omp) default(none) shared(dataset, val_images, sp_backend, dcnns)
 //    for (size_t i = 0; i < val_images.size(); ++i) {
 //        int tid = omp_get_thread_num();
 //        std::string fname(val_images[i]);
 //        std::stringstream ss;
 //        ss << "tid=" << tid << " Processing " << fname << std::endl;
 //        std::cout << ss.str(); // std::cout is thread-safe
-//        process_tif(dataset, fname, &dcnn, chip_overlap, dcnn_name, sp_size);
+//        process_tif(dataset, fname, runs, chip_overlap, sp_backend, sp_sizes, chip_size);
 //    }
+    for(auto const &dcnn: dcnns) {
+        std::cerr<<dcnn->name<<": ";
+        dcnn->inference->GetMetrics().Print(std::cerr);
+        if(!dcnn->profiler) continue;
+        dcnn->profiler->Print(std::cerr);
+        if(profile_trace.empty()) continue;
+        // one trace per model: trace.json becomes trace.<name>.json when there are several
+        fs::path trace = profile_trace[0];
+        if(dcnns.size() > 1)
+            trace.replace_filename(trace.stem().string() + "." + dcnn->name + trace.extension().string());
+        if(dcnn->profiler->WriteChromeTrace(trace.string()))
+            std::cerr<<"Wrote the trace of "<<dcnn->name<<" to "<<trace.string()<<std::endl;
+    }
     return 0;
 }
@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include "profiler.hpp"
+
+namespace spt::dnn {
+    namespace {
+        /// Rows of `timings` by decreasing total time
+        std::vector<std::pair<std::string, Profiler::Timing>> by_total(const std::map<std::string, Profiler::Timing> &timings) {
+            std::vector<std::pair<std::string, Profiler::Timing>> rows(timings.begin(), timings.end());
+            std::sort(rows.begin(), rows.end(), [](auto const &a, auto const &b) {
+                return a.second.total_micros > b.second.total_micros;
+            });
+            return rows;
+        }
+
+        void print_table(std::ostream &os, const char *title, const std::map<std::string, Profiler::Timing> &timings,
+                         size_t top) {
+            double total = 0;
+            for (auto const &t: timings) total += t.second.total_micros;
+            const std::ios::fmtflags flags = os.flags();
+            const std::streamsize precision = os.precision();
+            os << std::fixed << std::setprecision(3);
+            os << title << " (" << timings.size() << ", " << total / 1000.0 << " ms total)" << std::endl;
+            const auto rows = by_total(timings);
+            for (size_t i = 0; i < rows.size() && i < top; ++i) {
+                const Profiler::Timing &t = rows[i].second;
+                os << "  " << std::setw(48) << std::left << rows[i].first << std::right
+                   << std::setw(10) << t.count << " calls "
+                   << std::setw(12) << t.total_micros / 1000.0 << " ms "
+                   << std::setw(10) << t.total_micros / t.count << " us/call "
+                   << std::setw(10) << t.max_micros << " us max "
+                   << std::setprecision(1) << std::setw(6) << (total > 0 ? 100.0 * t.total_micros / total : 0.0)
+                   << "%" << std::setprecision(3) << std::endl;
+            }
+            os.flags(flags);
+            os.precision(precision);
+        }
+
+        void write_json_string(std::ostream &os, const std::string &s) {
+            os << '"';
+            for (const char c: s) {
+                if (c == '"' || c == '\\') os << '\\' << c;
+                else if (static_cast<unsigned char>(c) < 0x20) os << ' ';
+                else os << c;
+            }
+            os << '"';
+        }
+    }
+
+    void Profiler::Timing::Add(double micros) {
+        ++count;
+        total_micros += micros;
+        max_micros = std::max(max_micros, micros);
+    }
+
+    Profiler::Scope::Scope(Profiler *profiler, const char *stage) :
+            profiler(profiler), stage(stage), start_micros(0) {
+        if (!profiler) return;
+        start_micros = NowMicros();
+        start = std::chrono::steady_clock::now();
+    }
+
+    Profiler::Scope::~Scope() {
+        if (!profiler) return;
+        // the wall clock places the event, the steady clock measures it
+        const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        profiler->AddStage(stage, start_micros, micros);
+    }
+
+    int64_t Profiler::NowMicros() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    Profiler::Profiler(size_t max_events) : max_events(max_events) {
+    }
+
+    int Profiler::device_index(const std::string &device) {
+        auto it = std::find(devices.begin(), devices.end(), device);
+        if (it != devices.end()) return static_cast<int>(it - devices.begin());
+        devices.push_back(device);
+        return static_cast<int>(devices.size() - 1);
+    }
+
+    void Profiler::AddNode(const std::string &node, const std::string &op, const std::string &device,
+                           uint64_t thread, int64_t start_micros, int64_t duration_micros) {
+        const size_t slash = node.rfind('/');
+        const std::string layer = slash == std::string::npos ? node : node.substr(0, slash);
+        std::lock_guard<std::mutex> lock(mutex);
+        ops[op].Add((double) duration_micros);
+        layers[layer].Add((double) duration_micros);
+        if (events.size() < max_events)
+            events.push_back({node, op, device_index(device), thread, start_micros, duration_micros});
+    }
+
+    void Profiler::AddStage(const std::string &stage, int64_t start_micros, int64_t duration_micros) {
+        const uint64_t thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+        std::lock_guard<std::mutex> lock(mutex);
+        stages[stage].Add((double) duration_micros);
+        if (events.size() < max_events)
+            events.push_back({stage, "stage", -1, thread, start_micros, duration_micros});
+    }
+
+    void Profiler::Print(std::ostream &os, size_t top) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        os << "Profile" << std::endl;
+        print_table(os, "Stages", stages, stages.size());
+        print_table(os, "Ops", ops, top);
+        print_table(os, "Layers", layers, top);
+    }
+
+    bool Profiler::WriteChromeTrace(const std::string &path) const {
+        std::ofstream os(path);
+        if (!os) {
+            std::cerr << "Cannot write the trace to " << path << std::endl;
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        os << "{\"traceEvents\":[";
+        bool first = true;
+        auto separator = [&]() {
+            if (!first) os << ",\n";
+            first = false;
+        };
+        // pid 0 holds the C++ stages; devices follow
+        separator();
+        os << R"({"name":"process_name","ph":"M","pid":0,"args":{"name":"host"}})";
+        for (size_t i = 0; i < devices.size(); ++i) {
+            separator();
+            os << R"({"name":"process_name","ph":"M","pid":)" << i + 1 << R"(,"args":{"name":)";
+            write_json_string(os, devices[i]);
+            os << "}}";
+        }
+        for (auto const &e: events) {
+            separator();
+            os << "{\"name\":";
+            write_json_string(os, e.name);
+            os << ",\"cat\":";
+            write_json_string(os, e.category);
+            os << ",\"ph\":\"X\",\"ts\":" << e.start_micros
+               << ",\"dur\":" << e.duration_micros << ",\"pid\":" << e.device + 1 << ",\"tid\":" << e.thread << "}";
+        }
+        os << "]}" << std::endl;
+        return (bool) os;
+    }
+
+    bool Profiler::Empty() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stages.empty() && ops.empty();
+    }
+}
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include "segcache.hpp"
+
+namespace spt {
+    namespace {
+        constexpr uint32_t EntryVersion = 1;
+
+        struct EntryHeader {
+            uint32_t version;
+            int32_t rows, cols;
+            uint32_t num_superpixels;
+            uint32_t num_regions;
+            uint32_t num_runs;
+        };
+
+        /// RegionInfo as stored, independent of the struct's padding
+        struct StoredRegion {
+            float color[3];
+            float area;
+        };
+    }
+
+    std::string SegmentationSettings(const std::string &backend, const SuperpixelConfig &config) {
+        std::stringstream settings;
+        settings << backend << '|' << config.size.width << 'x' << config.size.height << '|' << config.superpixel_size
+                 << '|' << config.num_iter;
+        return settings.str();
+    }
+
+    bool SegmentationCache::Open(const std::string &path, bool writable) {
+        return store.Open(path, writable);
+    }
+
+    bool SegmentationCache::IsOpen() const {
+        return store.IsOpen();
+    }
+
+    size_t SegmentationCache::size() const {
+        return store.size();
+    }
+
+    std::string SegmentationCache::Key(uint64_t image_hash, const cv::Rect &roi, const std::string &settings) {
+        std::stringstream key;
+        key << std::hex << image_hash << std::dec << '|' << roi.x << ',' << roi.y << ',' << roi.width << ','
+            << roi.height << '|' << settings;
+        return key.str();
+    }
+
+    bool SegmentationCache::Store(const std::string &key, const cv::Mat &labels, unsigned int num_superpixels,
+                                  const std::vector<RegionInfo> *regions) {
+        CV_Assert(labels.type() == CV_32SC1);
+        // (label, length) runs in raster order; they may cross rows
+        std::vector<int32_t> runs;
+        int32_t label = -1, length = 0;
+        for (int y = 0; y < labels.rows; ++y) {
+            const int *lptr = labels.ptr<int>(y);
+            for (int x = 0; x < labels.cols; ++x) {
+                if (lptr[x] == label) {
+                    ++length;
+                    continue;
+                }
+                if (length > 0) {
+                    runs.push_back(label);
+                    runs.push_back(length);
+                }
+                label = lptr[x];
+                length = 1;
+            }
+        }
+        if (length > 0) {
+            runs.push_back(label);
+            runs.push_back(length);
+        }
+
+        const size_t num_regions = regions ? regions->size() : 0;
+        std::vector<char> entry(sizeof(EntryHeader) + num_regions * sizeof(StoredRegion) + runs.size() * sizeof(int32_t));
+        EntryHeader header{EntryVersion, labels.rows, labels.cols, num_superpixels, (uint32_t) num_regions,
+                           (uint32_t) (runs.size() / 2)};
+        char *p = entry.data();
+        std::memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+        for (size_t i = 0; i < num_regions; ++i) {
+            const RegionInfo &r = (*regions)[i];
+            const StoredRegion stored{{r.color[0], r.color[1], r.color[2]}, r.area};
+            std::memcpy(p, &stored, sizeof(stored));
+            p += sizeof(stored);
+        }
+        std::memcpy(p, runs.data(), runs.size() * sizeof(int32_t));
+        return store.Append(key, entry.data(), entry.size());
+    }
+
+    bool SegmentationCache::Load(const std::string &key, SegmentationResult &result, std::vector<RegionInfo> *regions) {
+        const void *data;
+        size_t size;
+        if (!store.Find(key, data, size) || size < sizeof(EntryHeader)) return false;
+        const char *p = static_cast<const char *>(data);
+        EntryHeader header;
+        std::memcpy(&header, p, sizeof(header));
+        if (header.version != EntryVersion ||
+            size != sizeof(EntryHeader) + header.num_regions * sizeof(StoredRegion) +
+                    (size_t) header.num_runs * 2 * sizeof(int32_t))
+            return false;
+        p += sizeof(header);
+
+        if (regions) {
+            regions->resize(header.num_regions);
+            for (uint32_t i = 0; i < header.num_regions; ++i) {
+                StoredRegion stored;
+                std::memcpy(&stored, p + i * sizeof(StoredRegion), sizeof(stored));
+                (*regions)[i].color = cv::Vec3f(stored.color[0], stored.color[1], stored.color[2]);
+                (*regions)[i].area = stored.area;
+            }
+        }
+        p += header.num_regions * sizeof(StoredRegion);
+
+        // runs are 8-byte aligned in the mapping, so they are read in place
+        const auto *runs = reinterpret_cast<const int32_t *>(p);
+        result.labels.create(header.rows, header.cols, CV_32SC1);
+        CV_Assert(result.labels.isContinuous());
+        int *out = result.labels.ptr<int>(), *out_end = out + (size_t) header.rows * header.cols;
+        for (uint32_t i = 0; i < header.num_runs; ++i) {
+            const int32_t label = runs[2 * i], length = runs[2 * i + 1];
+            if (length <= 0 || length > out_end - out) return false;
+            std::fill_n(out, length, label);
+            out += length;
+        }
+        if (out != out_end) return false;
+        result.num_superpixels = header.num_superpixels;
+        GetLabelContour(result.labels, result.contour);
+        return true;
+    }
+}
@@ -0,0 +1,116 @@
+#include <cmath>
+#include <algorithm>
+#include "spindex.hpp"
+
+namespace spt {
+    SuperpixelIndex *SuperpixelIndex::Compute(cv::InputArray _labels, unsigned int nsp) {
+        cv::Mat labels = _labels.getMat();
+        CV_Assert(labels.type() == CV_32SC1);
+        frame_size = labels.size();
+
+        // Pass 1: histogram of labels, shifted by one so the prefix sum lands in place
+        offsets.assign(nsp + 1, 0);
+        for (int y = 0; y < labels.rows; ++y) {
+            const int *lptr = labels.ptr<int>(y);
+            for (int x = 0; x < labels.cols; ++x) {
+                const int l = lptr[x];
+                CV_Assert(l >= 0);
+                if (l + 1 >= (int) offsets.size()) {
+                    CV_Assert(nsp == 0);
+                    offsets.resize(l + 2, 0);
+                }
+                ++offsets[l + 1];
+            }
+        }
+        for (size_t i = 1; i < offsets.size(); ++i)
+            offsets[i] += offsets[i - 1];
+
+        // Pass 2: scatter pixel offsets into their buckets
+        pixels.resize(frame_size.area());
+        std::vector<int> cursor(offsets.begin(), offsets.end() - 1);
+        for (int y = 0; y < labels.rows; ++y) {
+            const int *lptr = labels.ptr<int>(y);
+            const int row_offset = y * labels.cols;
+            for (int x = 0; x < labels.cols; ++x)
+                pixels[cursor[lptr[x]]++] = row_offset + x;
+        }
+        return this;
+    }
+
+    unsigned int SuperpixelIndex::GetNumSuperpixels() const {
+        return offsets.empty() ? 0 : static_cast<unsigned int>(offsets.size() - 1);
+    }
+
+    int SuperpixelIndex::GetArea(unsigned int superpixel_id) const {
+        if (superpixel_id >= GetNumSuperpixels()) return 0;
+        return offsets[superpixel_id + 1] - offsets[superpixel_id];
+    }
+
+    const int *SuperpixelIndex::begin(unsigned int superpixel_id) const {
+        return pixels.data() + offsets[std::min(superpixel_id, GetNumSuperpixels())];
+    }
+
+    const int *SuperpixelIndex::end(unsigned int superpixel_id) const {
+        return pixels.data() + offsets[std::min(superpixel_id + 1, GetNumSuperpixels())];
+    }
+
+    cv::Rect SuperpixelIndex::GetBoundingRect(unsigned int superpixel_id) const {
+        if (GetArea(superpixel_id) == 0) return cv::Rect();
+        const int *p = begin(superpixel_id), *q = end(superpixel_id);
+        // offsets are in raster order, so the rows are bounded by the first and last pixel
+        const int ymin = p[0] / frame_size.width, ymax = q[-1] / frame_size.width;
+        int xmin = frame_size.width, xmax = -1;
+        for (; p != q; ++p) {
+            const int x = *p % frame_size.width;
+            if (x < xmin) xmin = x;
+            if (x > xmax) xmax = x;
+        }
+        return cv::Rect(xmin, ymin, xmax - xmin + 1, ymax - ymin + 1);
+    }
+
+    void SuperpixelIndex::GetMask(unsigned int superpixel_id, cv::OutputArray output) const {
+        output.create(frame_size, CV_8UC1);
+        cv::Mat mask = output.getMat();
+        mask.setTo(0);
+        for (const int *p = begin(superpixel_id), *q = end(superpixel_id); p != q; ++p)
+            mask.ptr(*p / frame_size.width)[*p % frame_size.width] = 255;
+    }
+
+    void SuperpixelIndex::GetMask(unsigned int superpixel_id, cv::OutputArray output, cv::Rect &roi, int padding) const {
+        roi = GetBoundingRect(superpixel_id);
+        if (roi.empty()) {
+            output.create(cv::Size(1, 1), CV_8UC1);
+            output.getMat().setTo(0);
+            return;
+        }
+        roi = cv::Rect(roi.x - padding, roi.y - padding, roi.width + 2 * padding, roi.height + 2 * padding) &
+              cv::Rect(0, 0, frame_size.width, frame_size.height);
+        output.create(roi.size(), CV_8UC1);
+        cv::Mat mask = output.getMat();
+        mask.setTo(0);
+        for (const int *p = begin(superpixel_id), *q = end(superpixel_id); p != q; ++p)
+            mask.ptr(*p / frame_size.width - roi.y)[*p % frame_size.width - roi.x] = 255;
+    }
+
+    void SuperpixelIndex::MeanStdDev(cv::InputArray _frame, unsigned int superpixel_id, cv::Scalar &mean,
+                                     cv::Scalar &stddev) const {
+        cv::Mat frame = _frame.getMat();
+        CV_Assert(frame.depth() == CV_8U && frame.channels() <= 4 && frame.size() == frame_size);
+        const int cn = frame.channels();
+        double sum[4] = {0, 0, 0, 0}, sqsum[4] = {0, 0, 0, 0};
+        for (const int *p = begin(superpixel_id), *q = end(superpixel_id); p != q; ++p) {
+            const unsigned char *px = frame.ptr(*p / frame_size.width) + (*p % frame_size.width) * cn;
+            for (int c = 0; c < cn; ++c) {
+                sum[c] += px[c];
+                sqsum[c] += px[c] * px[c];
+            }
+        }
+        const int area = GetArea(superpixel_id);
+        mean = stddev = cv::Scalar();
+        if (area == 0) return;
+        for (int c = 0; c < cn; ++c) {
+            mean[c] = sum[c] / area;
+            stddev[c] = std::sqrt(std::max(sqsum[c] / area - mean[c] * mean[c], 0.0));
+        }
+    }
+}
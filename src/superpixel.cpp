@@ -1,20 +1,99 @@
+#include <algorithm>
 #include "superpixel.hpp"
 namespace spt {
+    void GetLabelContour(cv::InputArray _labels, cv::OutputArray output) {
+        cv::Mat labels = _labels.getMat();
+        CV_Assert(labels.type() == CV_32SC1);
+        output.create(labels.size(), CV_8UC1);
+        cv::Mat mask = output.getMat();
+        mask.setTo(0);
+        // Image borders are left out, as in gSLICr's Draw_Boundary_Mask
+        for (int y = 1; y < labels.rows - 1; ++y) {
+            const int *above = labels.ptr<int>(y - 1), *row = labels.ptr<int>(y), *below = labels.ptr<int>(y + 1);
+            unsigned char *optr = mask.ptr(y);
+            for (int x = 1; x < labels.cols - 1; ++x) {
+                const int l = row[x];
+                if (l != row[x + 1] || l != row[x - 1] || l != above[x] || l != below[x])
+                    optr[x] = 1;
+            }
+        }
+    }
+
+    std::future<std::shared_ptr<const SegmentationResult>> ISuperpixel::ComputeAsync(cv::InputArray frame) {
+        std::shared_ptr<AsyncContext> context = async_context;
+        std::shared_ptr<SegmentationResult> result;
+        cv::Mat frame_copy;
+        {
+            std::lock_guard<std::mutex> lock(context->slot_mutex);
+            // a slot is free once the ring holds the only reference to it
+            auto slot = std::find_if(context->slots.begin(), context->slots.end(),
+                                     [](const AsyncSlot &s) { return s.result.use_count() == 1; });
+            if (slot == context->slots.end() && context->slots.size() < num_async_buffers) {
+                context->slots.push_back({std::make_shared<SegmentationResult>(), cv::Mat()});
+                slot = context->slots.end() - 1;
+            }
+            if (slot != context->slots.end()) {
+                result = slot->result;
+                // claim the slot before leaving the lock; the input buffer is only touched by its claimant
+                frame.copyTo(slot->frame);
+                frame_copy = slot->frame;
+            } else {
+                // every buffer is still held by the caller: fall back to a one-off result
+                result = std::make_shared<SegmentationResult>();
+                frame.copyTo(frame_copy);
+            }
+        }
+        return std::async(std::launch::async, [this, context, result, frame_copy]() {
+            std::lock_guard<std::mutex> lock(context->compute_mutex);
+            Compute(frame_copy);
+            GetLabels(result->labels);
+            GetContour(result->contour);
+            result->num_superpixels = GetNumSuperpixels();
+            return std::shared_ptr<const SegmentationResult>(result);
+        });
+    }
+
     ISuperpixel *OpenCVSLIC::Compute(cv::InputArray frame) {
-        cv::medianBlur(frame, frame_hsv, 5);
-        cv::cvtColor(frame_hsv, frame_hsv, cv::COLOR_BGR2HSV);
+        if (streaming) {
+            preprocess(frame.getMat());
+        } else {
+            cv::medianBlur(frame, frame_hsv, 5);
+            cv::cvtColor(frame_hsv, frame_hsv, cv::COLOR_BGR2HSV);
+        }
+        // SuperpixelSLIC cannot be re-initialized with a new image, so only the buffers around it are reused
         segmentation = cv::ximgproc::createSuperpixelSLIC(
-                frame_hsv, cv::ximgproc::SLIC + 1, (int) superpixel_size, ruler);
+                frame_hsv, algorithm, (int) superpixel_size, ruler);
         segmentation->iterate(num_iter);
         segmentation->enforceLabelConnectivity(min_size);
         return dynamic_cast<ISuperpixel *>(this);
     }
 
-    OpenCVSLIC::OpenCVSLIC(float superpixel_size, float ruler, unsigned int num_iter, float min_size) {
+    void OpenCVSLIC::preprocess(const cv::Mat &frame) {
+        CV_Assert(frame.type() == CV_8UC3);
+        frame_hsv.create(frame.size(), CV_8UC3);
+        const int nstripes = std::max(std::min(cv::getNumThreads(), frame.rows / 16), 1);
+        if (stripe_buffers.size() != (size_t) nstripes) stripe_buffers.resize(nstripes);
+        cv::parallel_for_(cv::Range(0, nstripes), [&](const cv::Range &range) {
+            for (int t = range.start; t < range.end; ++t) {
+                const int y0 = frame.rows * t / nstripes, y1 = frame.rows * (t + 1) / nstripes;
+                // 2-row halo for the 5x5 median; at the frame edges medianBlur replicates just as on the whole frame
+                const int h0 = std::max(y0 - 2, 0), h1 = std::min(y1 + 2, frame.rows);
+                cv::Mat &blurred = stripe_buffers[t];
+                cv::medianBlur(frame.rowRange(h0, h1), blurred, 5);
+                cv::Mat dst = frame_hsv.rowRange(y0, y1);
+                cv::cvtColor(blurred.rowRange(y0 - h0, y1 - h0), dst, cv::COLOR_BGR2HSV);
+            }
+        });
+    }
+
+    OpenCVSLIC::OpenCVSLIC(float superpixel_size, float ruler, unsigned int num_iter, float min_size, int algorithm,
+                           bool streaming) {
         this->superpixel_size = superpixel_size;
         this->ruler = ruler;
         this->num_iter = num_iter;
         this->min_size = min_size;
+        this->algorithm = algorithm;
+        this->streaming = streaming;
     }
 
     void OpenCVSLIC::GetContour(cv::OutputArray output) {
@@ -29,6 +108,217 @@ namespace spt {
         return segmentation->getNumberOfSuperpixels();
     }
 
+    OpenCVSEEDS::OpenCVSEEDS(unsigned int num_superpixels, unsigned int num_iter, int num_levels, int prior,
+                             int histogram_bins) {
+        this->num_superpixels = num_superpixels;
+        this->num_iter = num_iter;
+        this->num_levels = num_levels;
+        this->prior = prior;
+        this->histogram_bins = histogram_bins;
+    }
+
+    ISuperpixel *OpenCVSEEDS::Compute(cv::InputArray frame) {
+        cv::cvtColor(frame, frame_hsv, cv::COLOR_BGR2HSV);
+        // Unlike SLIC/LSC, a SEEDS object can be re-run on new frames of the same size
+        if (!segmentation || frame_size != frame_hsv.size()) {
+            frame_size = frame_hsv.size();
+            segmentation = cv::ximgproc::createSuperpixelSEEDS(
+                    frame_size.width, frame_size.height, frame_hsv.channels(),
+                    (int) num_superpixels, num_levels, prior, histogram_bins);
+        }
+        segmentation->iterate(frame_hsv, (int) num_iter);
+        return dynamic_cast<ISuperpixel *>(this);
+    }
+
+    void OpenCVSEEDS::GetContour(cv::OutputArray output) {
+        segmentation->getLabelContourMask(output, true);
+    }
+
+    void OpenCVSEEDS::GetLabels(cv::OutputArray output) {
+        segmentation->getLabels(output);
+    }
+
+    unsigned int OpenCVSEEDS::GetNumSuperpixels() {
+        return segmentation->getNumberOfSuperpixels();
+    }
+
+    OpenCVLSC::OpenCVLSC(float superpixel_size, float ratio, unsigned int num_iter, float min_size) {
+        this->superpixel_size = superpixel_size;
+        this->ratio = ratio;
+        this->num_iter = num_iter;
+        this->min_size = min_size;
+    }
+
+    ISuperpixel *OpenCVLSC::Compute(cv::InputArray frame) {
+        cv::cvtColor(frame, frame_lab, cv::COLOR_BGR2Lab);
+        segmentation = cv::ximgproc::createSuperpixelLSC(frame_lab, (int) superpixel_size, ratio);
+        segmentation->iterate(num_iter);
+        segmentation->enforceLabelConnectivity(min_size);
+        return dynamic_cast<ISuperpixel *>(this);
+    }
+
+    void OpenCVLSC::GetContour(cv::OutputArray output) {
+        segmentation->getLabelContourMask(output, true);
+    }
+
+    void OpenCVLSC::GetLabels(cv::OutputArray output) {
+        segmentation->getLabels(output);
+    }
+
+    unsigned int OpenCVLSC::GetNumSuperpixels() {
+        return segmentation->getNumberOfSuperpixels();
+    }
+
+    GSLICCPU::GSLICCPU(int spixel_size, int no_iters, float coh_weight, bool do_enforce_connectivity) {
+        this->spixel_size = spixel_size;
+        this->no_iters = no_iters;
+        this->coh_weight = coh_weight;
+        this->do_enforce_connectivity = do_enforce_connectivity;
+    }
+
+    /// Generate superpixels for the frame (BGR format)
+    ISuperpixel *GSLICCPU::Compute(cv::InputArray frame) {
+        CV_Assert(frame.type() == CV_8UC3);
+        // Float input keeps L in [0, 100] and a, b in about [-128, 128], the same ranges as gSLICr's CIELAB
+        frame.getMat().convertTo(frame_lab, CV_32FC3, 1.0 / 255);
+        cv::cvtColor(frame_lab, frame_lab, cv::COLOR_BGR2Lab);
+        labels.create(frame_lab.size(), CV_32SC1);
+
+        map_width = std::max(frame_lab.cols / spixel_size, 1);
+        map_height = std::max(frame_lab.rows / spixel_size, 1);
+        centers.resize(map_width * map_height);
+        for (int y = 0; y < map_height; ++y) {
+            for (int x = 0; x < map_width; ++x) {
+                int img_x = x * spixel_size + spixel_size / 2;
+                int img_y = y * spixel_size + spixel_size / 2;
+                img_x = img_x >= frame_lab.cols ? (x * spixel_size + frame_lab.cols) / 2 : img_x;
+                img_y = img_y >= frame_lab.rows ? (y * spixel_size + frame_lab.rows) / 2 : img_y;
+                centers[y * map_width + x] = {(float) img_x, (float) img_y,
+                                              frame_lab.at<cv::Vec3f>(img_y, img_x), 0};
+            }
+        }
+
+        find_center_association();
+        for (int i = 0; i < no_iters; ++i) {
+            update_cluster_center();
+            find_center_association();
+        }
+        if (do_enforce_connectivity) {
+            supress_local_label(labels, labels_tmp);
+            supress_local_label(labels_tmp, labels);
+        }
+        return dynamic_cast<ISuperpixel *>(this);
+    }
+
+    void GSLICCPU::find_center_association() {
+        // Same normalizers as gSLICr for CIELAB
+        const float max_xy_dist = 1.0f / (1.4242f * spixel_size) / (1.4242f * spixel_size);
+        const float max_color_dist = (15.0f / (1.7321f * 128)) * (15.0f / (1.7321f * 128));
+        cv::parallel_for_(cv::Range(0, labels.rows), [&](const cv::Range &range) {
+            for (int y = range.start; y < range.end; ++y) {
+                const cv::Vec3f *fptr = frame_lab.ptr<cv::Vec3f>(y);
+                int *lptr = labels.ptr<int>(y);
+                const int ctr_y = y / spixel_size;
+                for (int x = 0; x < labels.cols; ++x) {
+                    const int ctr_x = x / spixel_size;
+                    float dist = 999999.9999f;
+                    int minidx = -1;
+                    // search 3x3 neighborhood
+                    for (int i = std::max(ctr_y - 1, 0); i <= std::min(ctr_y + 1, map_height - 1); ++i) {
+                        for (int j = std::max(ctr_x - 1, 0); j <= std::min(ctr_x + 1, map_width - 1); ++j) {
+                            const Center &c = centers[i * map_width + j];
+                            const cv::Vec3f d = fptr[x] - c.color;
+                            const float dx = x - c.x, dy = y - c.y;
+                            const float cdist = d.dot(d) * max_color_dist + coh_weight * (dx * dx + dy * dy) * max_xy_dist;
+                            if (cdist < dist) {
+                                dist = cdist;
+                                minidx = i * map_width + j;
+                            }
+                        }
+                    }
+                    if (minidx >= 0) lptr[x] = minidx;
+                }
+            }
+        });
+    }
+
+    void GSLICCPU::update_cluster_center() {
+        // Per-stripe partial sums, reduced serially; there are only as many stripes as threads
+        const int nstripes = std::max(std::min(cv::getNumThreads(), labels.rows), 1);
+        std::vector<std::vector<Center>> partial(nstripes, std::vector<Center>(centers.size(), {0, 0, cv::Vec3f(), 0}));
+        cv::parallel_for_(cv::Range(0, nstripes), [&](const cv::Range &range) {
+            for (int t = range.start; t < range.end; ++t) {
+                std::vector<Center> &acc = partial[t];
+                for (int y = labels.rows * t / nstripes; y < labels.rows * (t + 1) / nstripes; ++y) {
+                    const cv::Vec3f *fptr = frame_lab.ptr<cv::Vec3f>(y);
+                    const int *lptr = labels.ptr<int>(y);
+                    for (int x = 0; x < labels.cols; ++x) {
+                        Center &c = acc[lptr[x]];
+                        c.x += x;
+                        c.y += y;
+                        c.color += fptr[x];
+                        ++c.no_pixels;
+                    }
+                }
+            }
+        });
+        for (size_t i = 0; i < centers.size(); ++i) {
+            Center sum = {0, 0, cv::Vec3f(), 0};
+            for (const auto &acc: partial) {
+                sum.x += acc[i].x;
+                sum.y += acc[i].y;
+                sum.color += acc[i].color;
+                sum.no_pixels += acc[i].no_pixels;
+            }
+            // an empty cluster keeps its previous center instead of collapsing to the origin
+            if (sum.no_pixels > 0) {
+                const float n = (float) sum.no_pixels;
+                centers[i] = {sum.x / n, sum.y / n, sum.color / n, sum.no_pixels};
+            }
+        }
+    }
+
+    void GSLICCPU::supress_local_label(const cv::Mat &in_labels, cv::Mat &out_labels) {
+        out_labels.create(in_labels.size(), CV_32SC1);
+        cv::parallel_for_(cv::Range(0, in_labels.rows), [&](const cv::Range &range) {
+            for (int y = range.start; y < range.end; ++y) {
+                const int *iptr = in_labels.ptr<int>(y);
+                int *optr = out_labels.ptr<int>(y);
+                for (int x = 0; x < in_labels.cols; ++x) {
+                    const int clabel = iptr[x];
+                    // don't suppress boundary
+                    if (x <= 1 || y <= 1 || x >= in_labels.cols - 2 || y >= in_labels.rows - 2) {
+                        optr[x] = clabel;
+                        continue;
+                    }
+                    int diff_count = 0, diff_label = -1;
+                    for (int j = -2; j <= 2; ++j) {
+                        const int *nptr = in_labels.ptr<int>(y + j);
+                        for (int i = -2; i <= 2; ++i) {
+                            if (nptr[x + i] != clabel) {
+                                diff_label = nptr[x + i];
+                                ++diff_count;
+                            }
+                        }
+                    }
+                    optr[x] = diff_count >= 16 ? diff_label : clabel;
+                }
+            }
+        });
+    }
+
+    void GSLICCPU::GetContour(cv::OutputArray output) {
+        GetLabelContour(labels, output);
+    }
+
+    void GSLICCPU::GetLabels(cv::OutputArray output) {
+        labels.copyTo(output);
+    }
+
+    unsigned int GSLICCPU::GetNumSuperpixels() {
+        return static_cast<unsigned int>(centers.size());
+    }
+
 #ifdef HAS_LIBGSLIC
 
     GSLIC::GSLIC() :
@@ -50,26 +340,27 @@ namespace spt {
         CV_Assert(frame.cols == (int) width && frame.rows == (int) height);
         copy_image(frame, in_img.get());
         gSLICr_engine->Process_Frame(in_img.get());
+        actual_num_superpixels = 0;
         return dynamic_cast<ISuperpixel *>(this);
     }
 
     void GSLIC::GetContour(cv::OutputArray output) {
-        cv::Mat outmat;
-        outmat.create(cv::Size(width, height), CV_8UC1);
+        output.create(cv::Size(width, height), CV_8UC1);
+        cv::Mat outmat = output.getMat();
+        CV_Assert(outmat.isContinuous());
         gSLICr::MaskImage out_img({(int) width, (int) height}, false, true);
         out_img.use_data_cpu(outmat.data);
         gSLICr_engine->Draw_Boundary_Mask(&out_img);
         out_img.force_download();
         // copy_image(&out_img, outmat); // saved a copy by having OpenCV own data.
-        output.assign(outmat);
     }
 
     void GSLIC::GetLabels(cv::OutputArray output) {
-        cv::Mat outmat;
-        outmat.create(cv::Size(width, height), CV_32SC1);
+        // write into the caller's buffer when it already has the right size (e.g. recycled async results)
+        output.create(cv::Size(width, height), CV_32SC1);
+        cv::Mat outmat = output.getMat();
         const gSLICr::IntImage *segmentation = gSLICr_engine->Get_Seg_Res();
         copy_image_c1(segmentation, outmat);
-        output.assign(outmat);
         if (actual_num_superpixels == 0) { // compute num of superpixels while we are at it
             double m = 0;
             cv::minMaxIdx(outmat, nullptr, &m);
@@ -86,6 +377,18 @@ namespace spt {
         return actual_num_superpixels;
     }
 
+    void GSLIC::GetRegionInfo(std::vector<RegionInfo> &output) {
+        const gSLICr::SpixelMap *spixel_map = gSLICr_engine->Get_Spixel_Map();
+        const gSLICr::objects::spixel_info *spixel_ptr = spixel_map->GetData(MEMORYDEVICE_CPU);
+        const int n = spixel_map->noDims.x * spixel_map->noDims.y;
+        output.resize(n);
+        for (int i = 0; i < n; ++i) {
+            const auto &info = spixel_ptr[i];
+            output[info.id].color = cv::Vec3f(info.color_info.x, info.color_info.y, info.color_info.z);
+            output[info.id].area = static_cast<float>(info.no_pixels);
+        }
+    }
+
     void GSLIC::copy_image(const cv::Mat &inimg, gSLICr::UChar4Image *outimg) {
         gSLICr::Vector4u *outimg_ptr = outimg->GetData(MEMORYDEVICE_CPU);
 
@@ -114,5 +417,75 @@ namespace spt {
             }
         }
     }
-}
 #endif
+
+#ifdef HAS_LIBGSLIC
+    gSLICr::objects::settings GSLICSettings(const SuperpixelConfig &config) {
+        return gSLICr::objects::settings{
+                .img_size = {config.size.width, config.size.height},
+                .no_segs = 64,
+                .spixel_size = config.superpixel_size,
+                .no_iters = config.num_iter,
+                .coh_weight = 0.6f,
+                .do_enforce_connectivity = true,
+                .color_space = gSLICr::CIELAB,
+                .seg_method = gSLICr::GIVEN_SIZE
+        };
+    }
+#endif
+
+    SuperpixelRegistry &SuperpixelRegistry::Instance() {
+        static SuperpixelRegistry registry = [] {
+            SuperpixelRegistry r;
+            // OpenCV SLIC variants share the parameters used by the analyzer
+            r.Register("slic", [](const SuperpixelConfig &c) {
+                return std::make_unique<OpenCVSLIC>(c.superpixel_size, 30.0f, c.num_iter, 10.0f, cv::ximgproc::SLIC, true);
+            });
+            r.Register("slico", [](const SuperpixelConfig &c) {
+                return std::make_unique<OpenCVSLIC>(c.superpixel_size, 30.0f, c.num_iter, 10.0f, cv::ximgproc::SLICO, true);
+            });
+            r.Register("mslic", [](const SuperpixelConfig &c) {
+                return std::make_unique<OpenCVSLIC>(c.superpixel_size, 30.0f, c.num_iter, 10.0f, cv::ximgproc::MSLIC, true);
+            });
+            r.Register("seeds", [](const SuperpixelConfig &c) {
+                const int nx = std::max(c.size.width / c.superpixel_size, 1),
+                        ny = std::max(c.size.height / c.superpixel_size, 1);
+                return std::make_unique<OpenCVSEEDS>(nx * ny, c.num_iter);
+            });
+            r.Register("lsc", [](const SuperpixelConfig &c) {
+                return std::make_unique<OpenCVLSC>(c.superpixel_size, 0.075f, c.num_iter, 10.0f);
+            });
+            r.Register("gslic-cpu", [](const SuperpixelConfig &c) {
+                return std::make_unique<GSLICCPU>(c.superpixel_size, c.num_iter, 0.6f, true);
+            });
+#ifdef HAS_LIBGSLIC
+            r.Register("gslic", [](const SuperpixelConfig &c) {
+                return std::make_unique<GSLIC>(GSLICSettings(c));
+            });
+#endif
+            return r;
+        }();
+        return registry;
+    }
+
+    void SuperpixelRegistry::Register(const std::string &name, Factory factory) {
+        factories[name] = std::move(factory);
+    }
+
+    std::unique_ptr<ISuperpixel> SuperpixelRegistry::Create(const std::string &name, const SuperpixelConfig &config) const {
+        auto const &factory = factories.find(name);
+        if (factory == factories.end()) return nullptr;
+        return factory->second(config);
+    }
+
+    bool SuperpixelRegistry::Has(const std::string &name) const {
+        return factories.find(name) != factories.end();
+    }
+
+    std::vector<std::string> SuperpixelRegistry::Names() const {
+        std::vector<std::string> names;
+        for (auto const &factory: factories)
+            names.push_back(factory.first);
+        return names;
+    }
+}
@@ -0,0 +1,84 @@
+#define BOOST_TEST_MODULE test_bboxindex
+#include <string>
+#include <vector>
+#include <boost/test/included/unit_test.hpp>
+
+#include "bboxindex.hpp"
+
+spt::LabelledBBox bbox(double xmin, double ymin, double xmax, double ymax, int type_id) {
+    return {xmin, ymin, xmax, ymax, (xmax - xmin) * (ymax - ymin), type_id, "type" + std::to_string(type_id)};
+}
+
+/// xview_type_id of every match, in match order
+std::vector<int> match_types(const spt::BBoxIndex &index, double x, double y) {
+    std::vector<int> matches, types;
+    index.Match(x, y, matches);
+    for (const int i: matches)
+        types.push_back(index.GetBBox(i).xview_type_id);
+    return types;
+}
+
+BOOST_AUTO_TEST_CASE(test_inclusive_edges) {
+    spt::BBoxIndex index;
+    // the second box ends on the grid's last cell boundary
+    index.Compute({bbox(0, 0, 10, 10, 1), bbox(20, 20, 40, 40, 2)}, 10);
+    BOOST_TEST(match_types(index, 10, 10) == std::vector<int>({1}));
+    BOOST_TEST(match_types(index, 0, 0) == std::vector<int>({1}));
+    BOOST_TEST(match_types(index, 10, 5) == std::vector<int>({1}));
+    BOOST_TEST(match_types(index, 40, 40) == std::vector<int>({2}));
+    BOOST_TEST(match_types(index, 40, 20) == std::vector<int>({2}));
+    BOOST_TEST(match_types(index, 20, 40) == std::vector<int>({2}));
+    BOOST_TEST(match_types(index, 10.5, 10).empty());
+    BOOST_TEST(index.Count(10, 10) == 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_nested_smallest_first) {
+    spt::BBoxIndex index;
+    // given largest first; matches come back by area like sql_match_bbox2's order by st_area
+    index.Compute({bbox(0, 0, 100, 100, 1), bbox(10, 10, 60, 60, 2), bbox(20, 20, 30, 30, 3)});
+    BOOST_TEST(index.size() == 3u);
+    BOOST_TEST(match_types(index, 25, 25) == std::vector<int>({3, 2, 1}));
+    BOOST_TEST(match_types(index, 50, 50) == std::vector<int>({2, 1}));
+    BOOST_TEST(match_types(index, 90, 90) == std::vector<int>({1}));
+    BOOST_TEST(index.Count(25, 25) == 3);
+}
+
+BOOST_AUTO_TEST_CASE(test_multi_cell) {
+    spt::BBoxIndex index;
+    // with 10 pixel cells the wide box spans 8 x 2 cells
+    index.Compute({bbox(5, 5, 85, 15, 1), bbox(50, 0, 52, 100, 2)}, 10);
+    for (double x: {5.0, 25.0, 49.0, 85.0})
+        BOOST_TEST(match_types(index, x, 10) == std::vector<int>({1}));
+    BOOST_TEST(match_types(index, 51, 10) == std::vector<int>({2, 1}));
+    BOOST_TEST(match_types(index, 51, 95) == std::vector<int>({2}));
+
+    // listed in every cell it overlaps, but intersected once
+    std::vector<int> matches;
+    index.Intersect(0, 0, 100, 100, matches);
+    BOOST_TEST(matches.size() == 2u);
+    index.Intersect(60, 0, 70, 4, matches);
+    BOOST_TEST(matches.empty());
+    index.Intersect(60, 0, 70, 5, matches);
+    BOOST_TEST(matches.size() == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_outside_grid) {
+    spt::BBoxIndex index;
+    index.Compute({bbox(100, 100, 200, 200, 1)}, 10);
+    BOOST_TEST(match_types(index, 99, 150).empty());
+    BOOST_TEST(match_types(index, 150, 99).empty());
+    BOOST_TEST(match_types(index, 201, 150).empty());
+    BOOST_TEST(match_types(index, 150, 201).empty());
+    BOOST_TEST(match_types(index, -1e12, 1e12).empty());
+    BOOST_TEST(index.Count(1e12, 1e12) == 0);
+    std::vector<int> matches;
+    index.Intersect(300, 300, 400, 400, matches);
+    BOOST_TEST(matches.empty());
+
+    // no boxes, no grid
+    spt::BBoxIndex empty;
+    empty.Compute({});
+    BOOST_TEST(match_types(empty, 0, 0).empty());
+    empty.Intersect(0, 0, 1, 1, matches);
+    BOOST_TEST(matches.empty());
+}
@@ -0,0 +1,69 @@
+#define BOOST_TEST_MODULE test_misc_ocv
+#include <boost/test/included/unit_test.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "misc_ocv.hpp"
+
+/// Every pixel labelled with its own index, so any misplaced sample shows up
+cv::Mat ramp_labels(int width, int height) {
+    cv::Mat labels(height, width, CV_32SC1);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+            labels.at<int>(y, x) = y * width + x;
+    return labels;
+}
+
+/// Pixels of `labels` that differ from cv::resize's INTER_NEAREST of `input`
+int count_mismatches(const cv::Mat &input, const cv::Mat &labels) {
+    cv::Mat expected;
+    cv::resize(input, expected, labels.size(), 0, 0, cv::INTER_NEAREST);
+    int mismatches = 0;
+    for (int y = 0; y < labels.rows; ++y)
+        for (int x = 0; x < labels.cols; ++x)
+            mismatches += labels.at<int>(y, x) != expected.at<int>(y, x);
+    return mismatches;
+}
+
+BOOST_AUTO_TEST_CASE(test_resize_nearest_labels_downscale) {
+    const cv::Mat input = ramp_labels(385, 385);
+    cv::Mat labels;
+    cv_misc::ResizeNearestLabels(input, labels, cv::Size(224, 224));
+    BOOST_TEST(labels.type() == CV_32SC1);
+    BOOST_TEST((labels.size() == cv::Size(224, 224)));
+    BOOST_TEST(count_mismatches(input, labels) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_resize_nearest_labels_upscale) {
+    const cv::Mat input = ramp_labels(256, 256);
+    cv::Mat labels;
+    cv_misc::ResizeNearestLabels(input, labels, cv::Size(500, 500));
+    BOOST_TEST((labels.size() == cv::Size(500, 500)));
+    BOOST_TEST(count_mismatches(input, labels) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_resize_nearest_labels_non_square) {
+    const cv::Mat input = ramp_labels(7, 3);
+    cv::Mat labels;
+    cv_misc::ResizeNearestLabels(input, labels, cv::Size(16, 9));
+    BOOST_TEST(count_mismatches(input, labels) == 0);
+
+    // down in one axis, up in the other
+    const cv::Mat wide = ramp_labels(640, 120);
+    cv_misc::ResizeNearestLabels(wide, labels, cv::Size(224, 224));
+    BOOST_TEST(count_mismatches(wide, labels) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_resize_nearest_labels_in_place) {
+    const cv::Mat input = ramp_labels(300, 200);
+    cv::Mat labels(224, 224, CV_32SC1, cv::Scalar(-1));
+    const void *data = labels.data;
+    cv_misc::ResizeNearestLabels(input, labels, labels.size());
+    BOOST_TEST(labels.data == data);
+    BOOST_TEST(count_mismatches(input, labels) == 0);
+
+    // same size is a copy
+    cv::Mat same;
+    cv_misc::ResizeNearestLabels(input, same, input.size());
+    BOOST_TEST(count_mismatches(input, same) == 0);
+}
@@ -1,5 +1,7 @@
 #define BOOST_TEST_MODULE test_pq
 #include <string>
+#include <cstring>
+#include <algorithm>
 #include <vector>
 #include <tuple>
 #include <iostream>
@@ -70,4 +72,54 @@ BOOST_AUTO_TEST_CASE(test_stream_to) {
         std::cerr<<e.what()<<std::endl;
         BOOST_TEST(false);
     }
-}
\ No newline at end of file
+}
+BOOST_AUTO_TEST_CASE(test_binary_copy_encoding) {
+    spt::pgsaver::BinaryCopyBuffer buffer;
+    buffer.BeginRow(2);
+    buffer.Int4(7);
+    const float feature[2] {1.0f, -2.0f};
+    buffer.Array<float>(feature, 2);
+    buffer.End();
+    const unsigned char expected[] {
+        'P', 'G', 'C', 'O', 'P', 'Y', '\n', 0xff, '\r', '\n', 0, // signature
+        0, 0, 0, 0, 0, 0, 0, 0, // flags, header extension
+        0, 2, // fields
+        0, 0, 0, 4, 0, 0, 0, 7, // int4
+        0, 0, 0, 36, // real[]: ndim, has nulls, element oid, size, lower bound, (length, value) * 2
+        0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0x02, 0xbc, 0, 0, 0, 2, 0, 0, 0, 1,
+        0, 0, 0, 4, 0x3f, 0x80, 0, 0, 0, 0, 0, 4, 0xc0, 0, 0, 0,
+        0xff, 0xff // trailer
+    };
+    BOOST_TEST(buffer.size() == sizeof(expected));
+    BOOST_TEST(std::memcmp(buffer.data(), expected, std::min(buffer.size(), sizeof(expected))) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_binary_copy) {
+    std::string name = "b";
+    std::vector<std::vector<float>> features {
+        {1.0f, 0.0f, 0.0f},
+        {1.0f, 1.0f, 0.0f},
+        {},
+    };
+    try {
+        pqxx::connection conn(connection);
+        conn.prepare("sql_ct", "select count(*) from test_stream");
+        int ct0 = test_stream_count(conn), ct1;
+        spt::pgsaver::BinaryCopyWriter s {
+            connection, "test_stream",
+            std::vector<std::string> {
+                "name", "feature"
+            }
+        };
+        for(auto const &feature: features)
+            s.WriteRow(name, spt::pgsaver::array_ref(feature.data(), feature.size()));
+        s.complete();
+        ct1 = test_stream_count(conn);
+        BOOST_TEST(ct1-ct0 == features.size());
+        BOOST_TEST(s.GetRows() == features.size());
+    }
+    catch (const std::exception &e) {
+        std::cerr<<e.what()<<std::endl;
+        BOOST_TEST(false);
+    }
+}
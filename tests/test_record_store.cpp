@@ -0,0 +1,70 @@
+#define BOOST_TEST_MODULE test_record_store
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <boost/test/included/unit_test.hpp>
+
+#include "misc_os.hpp"
+
+std::string store_path(const char *name) {
+    return std::string("/tmp/") + name + "." + std::to_string(::getpid()) + ".rec";
+}
+
+// More records than vm.max_map_count's default of 65530, each appended on its own
+BOOST_AUTO_TEST_CASE(test_append_many) {
+    const std::string path = store_path("test_append_many");
+    std::remove(path.c_str());
+    const int n = 100000;
+    {
+        os_misc::RecordStore store;
+        BOOST_TEST(store.Open(path));
+        bool appended = true;
+        for (int i = 0; i < n && appended; ++i)
+            appended = store.Append("k" + std::to_string(i), &i, sizeof(i));
+        BOOST_TEST(appended);
+        BOOST_TEST(store.size() == (size_t) n);
+
+        // the process can still allocate
+        void *p = std::malloc(1 << 20);
+        BOOST_TEST(p != nullptr);
+        std::free(p);
+
+        bool found = true;
+        for (int i = 0; i < n && found; i += 997) {
+            const void *data;
+            size_t size;
+            found = store.Find("k" + std::to_string(i), data, size) && size == sizeof(int) &&
+                    *static_cast<const int *>(data) == i;
+        }
+        BOOST_TEST(found);
+    }
+
+    os_misc::RecordStore store;
+    BOOST_TEST(store.Open(path, false));
+    BOOST_TEST(store.size() == (size_t) n);
+    const void *data;
+    size_t size;
+    BOOST_TEST(store.Find("k" + std::to_string(n - 1), data, size));
+    BOOST_TEST(*static_cast<const int *>(data) == n - 1);
+    store.Close();
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_latest_wins) {
+    const std::string path = store_path("test_latest_wins");
+    std::remove(path.c_str());
+    os_misc::RecordStore store;
+    BOOST_TEST(store.Open(path));
+    const std::vector<float> a {1.0f, 2.0f}, b {3.0f};
+    BOOST_TEST(store.Append("key", a.data(), a.size() * sizeof(float)));
+    BOOST_TEST(store.Append("key", b.data(), b.size() * sizeof(float)));
+    const void *data;
+    size_t size;
+    BOOST_TEST(store.Find("key", data, size));
+    BOOST_TEST(size == sizeof(float));
+    BOOST_TEST(*static_cast<const float *>(data) == 3.0f);
+    BOOST_TEST(!store.Find("missing", data, size));
+    store.Close();
+    std::remove(path.c_str());
+}